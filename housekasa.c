@@ -47,9 +47,29 @@
 #include "housedepositor.h"
 
 #include "housekasa_device.h"
+#include "housekasa_encoding.h"
+#include "housekasa_metrics.h"
+#include "housekasa_profile.h"
+#include "housekasa_replay.h"
+#include "housekasa_resolve.h"
+#include "housekasa_shard.h"
+#include "housekasa_timer.h"
 
 static int LiveState = 0;
 
+static int StatusCache = -1;
+static int ConfigCache = -1;
+
+static const char *KasaPublic = "/usr/local/share/house/public";
+
+static int ProfilePortal = 0;
+static int ProfileDevice = 0;
+static int ProfileSave = 0;
+static int ProfileDiscover = 0;
+static int ProfileLog = 0;
+static int ProfileConfig = 0;
+static int ProfileDepositor = 0;
+
 static const char *housekasa_status (const char *method, const char *uri,
                                     const char *data, int length) {
 
@@ -59,9 +79,26 @@ static const char *housekasa_status (const char *method, const char *uri,
     ParserToken token[1024];
     char pool[65537];
     char host[256];
+    char etag[64];
     int count = housekasa_device_count();
     int i;
 
+    // The same response is shared by all clients polling within the same
+    // second, and not sent at all to those who already have this version.
+    //
+    long version = housestate_current (LiveState);
+    time_t now = time(0);
+    snprintf (etag, sizeof(etag), "W/\"s%ld\"", version);
+    if (housekasa_encoding_unmodified (etag)) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+    long long key = ((long long)version << 32) | (now & 0xffffffff);
+    if (housekasa_encoding_current (StatusCache, key)) {
+        echttp_content_type_json ();
+        return housekasa_encoding_reply (StatusCache);
+    }
+
     gethostname (host, sizeof(host));
 
     ParserContext context = echttp_json_start (token, 1024, pool, 65537);
@@ -69,16 +106,18 @@ static const char *housekasa_status (const char *method, const char *uri,
     int root = echttp_json_add_object (context, 0, 0);
     echttp_json_add_string (context, root, "host", host);
     echttp_json_add_string (context, root, "proxy", houseportal_server());
-    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
-    echttp_json_add_integer (context, root, "latest", housestate_current(LiveState));
+    echttp_json_add_integer (context, root, "timestamp", (long)now);
+    echttp_json_add_integer (context, root, "latest", version);
     int top = echttp_json_add_object (context, root, "control");
     int container = echttp_json_add_object (context, top, "status");
 
     for (i = 0; i < count; ++i) {
+        if (!housekasa_device_owned(i)) continue; // Reported by its owner.
         time_t pulsed = housekasa_device_deadline(i);
         const char *name = housekasa_device_name(i);
         const char *status = housekasa_device_failure(i);
         int priority = housekasa_device_priority(i);
+        int brightness = housekasa_device_brightness(i);
         if (!status) status = housekasa_device_get(i)?"on":"off";
         const char *commanded = housekasa_device_commanded(i)?"on":"off";
 
@@ -90,6 +129,10 @@ static const char *housekasa_status (const char *method, const char *uri,
             echttp_json_add_integer (context, point, "pulse", (int)pulsed);
         if (priority)
             echttp_json_add_bool (context, point, "priority", priority);
+        if (housekasa_device_stale(i))
+            echttp_json_add_bool (context, point, "stale", 1);
+        if (brightness >= 0)
+            echttp_json_add_integer (context, point, "brightness", brightness);
         echttp_json_add_string (context, point, "gear", "light");
     }
     const char *error = echttp_json_export (context, buffer, 65537);
@@ -97,32 +140,232 @@ static const char *housekasa_status (const char *method, const char *uri,
         echttp_error (500, error);
         return "";
     }
+    housekasa_encoding_store (StatusCache, key, buffer);
     echttp_content_type_json ();
-    return buffer;
+    return housekasa_encoding_reply (StatusCache);
+}
+
+static int housekasa_set_point (const char *point, int state, int pulse,
+                                int brightness, const char *cause) {
+    int i;
+    int count = housekasa_device_count();
+    int found = 0;
+
+    for (i = 0; i < count; ++i) {
+       if (!housekasa_device_owned(i)) continue;
+       if ((strcmp (point, "all") == 0) ||
+           (strcmp (point, housekasa_device_name(i)) == 0)) {
+           if (brightness >= 0) {
+               if (housekasa_device_set_brightness (i, brightness, cause))
+                   found = 1;
+           }
+           if (state >= 0) {
+               found = 1;
+               housekasa_device_set (i, state, pulse, cause);
+           }
+       }
+    }
+    return found;
+}
+
+static int housekasa_set_known (const char *point) {
+    int i;
+    int count = housekasa_device_count();
+    if (strcmp (point, "all") == 0) return 1;
+    for (i = 0; i < count; ++i) {
+        if (!housekasa_device_owned(i)) continue;
+        if (strcmp (point, housekasa_device_name(i)) == 0) return 1;
+    }
+    return 0;
+}
+
+static int housekasa_set_dimmable (const char *point) {
+    int i;
+    int count = housekasa_device_count();
+    int all = (strcmp (point, "all") == 0);
+    for (i = 0; i < count; ++i) {
+        if (!housekasa_device_owned(i)) continue;
+        if (housekasa_device_brightness(i) < 0) continue;
+        if (all || (strcmp (point, housekasa_device_name(i)) == 0)) return 1;
+    }
+    return 0;
+}
+
+// Decode one entry of a batch set request. The state can be a string
+// ("on", "off", "1" or "0"), a boolean or an integer.
+//
+static const char *housekasa_set_entry (ParserToken *json, int entry,
+                                        const char **point, int *state,
+                                        int *pulse, int *brightness,
+                                        const char **cause) {
+    int i;
+
+    i = echttp_json_search (json+entry, ".point");
+    if (i < 0 || json[entry+i].type != PARSER_STRING) return "missing point name";
+    *point = json[entry+i].value.string;
+
+    *brightness = -1;
+    i = echttp_json_search (json+entry, ".brightness");
+    if (i >= 0) {
+        if (json[entry+i].type != PARSER_INTEGER) return "invalid brightness value";
+        *brightness = (int)(json[entry+i].value.integer);
+        if (*brightness < 1 || *brightness > 100) return "invalid brightness value";
+    }
+
+    *state = -1;
+    i = echttp_json_search (json+entry, ".state");
+    if (i < 0) {
+        if (*brightness < 0) return "missing state value";
+    } else {
+        ParserToken *token = json + entry + i;
+        switch (token->type) {
+        case PARSER_STRING:
+            if ((strcmp(token->value.string, "on") == 0) ||
+                (strcmp(token->value.string, "1") == 0)) *state = 1;
+            else if ((strcmp(token->value.string, "off") == 0) ||
+                     (strcmp(token->value.string, "0") == 0)) *state = 0;
+            break;
+        case PARSER_BOOL:
+            *state = token->value.bool ? 1 : 0;
+            break;
+        case PARSER_INTEGER:
+            if (token->value.integer == 0 || token->value.integer == 1)
+                *state = (int)(token->value.integer);
+            break;
+        default:
+            break;
+        }
+        if (*state < 0) return "invalid state value";
+    }
+
+    *pulse = 0;
+    i = echttp_json_search (json+entry, ".pulse");
+    if (i >= 0) {
+        if (json[entry+i].type != PARSER_INTEGER) return "invalid pulse value";
+        *pulse = (int)(json[entry+i].value.integer);
+        if (*pulse < 0) return "invalid pulse value";
+    }
+
+    *cause = 0;
+    i = echttp_json_search (json+entry, ".cause");
+    if (i >= 0 && json[entry+i].type == PARSER_STRING)
+        *cause = json[entry+i].value.string;
+
+    return 0;
+}
+
+// A batch set request is a JSON array of {point, state, pulse, cause}
+// entries, typically a scene. All entries are validated before any is
+// applied, so that an invalid scene does not leave the lights half set.
+// The resulting commands are sent as one batch, grouped per device.
+//
+static const char *housekasa_set_batch (const char *method, const char *uri,
+                                        const char *data, int length) {
+
+    static ParserToken json[4096];
+    int count = 4096;
+    int pass, i;
+    char message[256];
+
+    if (!data || length <= 0) {
+        echttp_error (400, "missing data");
+        return "";
+    }
+
+    char *buffer = malloc (length+1);
+    memcpy (buffer, data, length);
+    buffer[length] = 0;
+
+    const char *error = echttp_json_parse (buffer, json, &count);
+    if (error) {
+        echttp_error (400, error);
+        free (buffer);
+        return "";
+    }
+    if (json[0].type != PARSER_ARRAY) {
+        echttp_error (400, "an array was expected");
+        free (buffer);
+        return "";
+    }
+
+    for (pass = 0; pass < 2; ++pass) {
+        if (pass) housekasa_device_batch_start ();
+        for (i = 0; i < json[0].length; ++i) {
+            const char *point = 0;
+            const char *cause = 0;
+            int state = -1;
+            int pulse = 0;
+            int brightness = -1;
+            char path[32];
+
+            snprintf (path, sizeof(path), "[%d]", i);
+            int entry = echttp_json_search (json, path);
+            if (entry < 0 || json[entry].type != PARSER_OBJECT) {
+                error = "an object was expected";
+            } else {
+                error = housekasa_set_entry (json, entry, &point, &state,
+                                             &pulse, &brightness, &cause);
+            }
+            int status = 400;
+            if (!error && !pass && !housekasa_set_known (point)) {
+                error = "invalid point name";
+                status = 404;
+            }
+            if (!error && !pass && brightness >= 0 &&
+                !housekasa_set_dimmable (point)) {
+                error = "not a dimmer";
+            }
+            if (error) {
+                // Do not leave the batch mode active: send what was
+                // already recorded as commanded.
+                if (pass) housekasa_device_batch_flush ();
+                snprintf (message, sizeof(message), "entry %d: %s", i, error);
+                echttp_error (status, message);
+                free (buffer);
+                return "";
+            }
+            if (pass)
+                housekasa_set_point (point, state, pulse, brightness, cause);
+        }
+    }
+    housekasa_device_batch_flush ();
+    free (buffer);
+
+    return housekasa_status (method, uri, data, length);
 }
 
 static const char *housekasa_set (const char *method, const char *uri,
                                  const char *data, int length) {
 
+    if (strcmp ("POST", method) == 0)
+        return housekasa_set_batch (method, uri, data, length);
+
     const char *point = echttp_parameter_get("point");
     const char *statep = echttp_parameter_get("state");
     const char *pulsep = echttp_parameter_get("pulse");
     const char *cause = echttp_parameter_get("cause");
-    int state;
+    const char *brightnessp = echttp_parameter_get("brightness");
+    int state = -1;
     int pulse;
-    int i;
-    int count = housekasa_device_count();
-    int found = 0;
+    int brightness = -1;
 
     if (!point) {
         echttp_error (404, "missing point name");
         return "";
     }
-    if (!statep) {
-        echttp_error (400, "missing state value");
-        return "";
+    if (brightnessp) {
+        brightness = atoi(brightnessp);
+        if (brightness < 1 || brightness > 100) {
+            echttp_error (400, "invalid brightness value");
+            return "";
+        }
     }
-    if ((strcmp(statep, "on") == 0) || (strcmp(statep, "1") == 0)) {
+    if (!statep) {
+        if (brightness < 0) {
+            echttp_error (400, "missing state value");
+            return "";
+        }
+    } else if ((strcmp(statep, "on") == 0) || (strcmp(statep, "1") == 0)) {
         state = 1;
     } else if ((strcmp(statep, "off") == 0) || (strcmp(statep, "0") == 0)) {
         state = 0;
@@ -137,19 +380,73 @@ static const char *housekasa_set (const char *method, const char *uri,
         return "";
     }
 
+    if (! housekasa_set_point (point, state, pulse, brightness, cause)) {
+        echttp_error (404, "invalid point name");
+        return "";
+    }
+    return housekasa_status (method, uri, data, length);
+}
+
+static const char *housekasa_metrics (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    static char buffer[65537];
+    if (!housekasa_metrics_export (buffer, sizeof(buffer))) {
+        echttp_error (500, "metrics buffer too small");
+        return "";
+    }
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return buffer;
+}
+
+static const char *housekasa_inventory (int point) {
+
+    static char buffer[65537];
+    const char *error = housekasa_device_inventory (point, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *housekasa_device (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    int i;
+    int count = housekasa_device_count();
+    const char *point = echttp_parameter_get("point");
+
+    if (!point) {
+        echttp_error (404, "missing point name");
+        return "";
+    }
     for (i = 0; i < count; ++i) {
-       if ((strcmp (point, "all") == 0) ||
-           (strcmp (point, housekasa_device_name(i)) == 0)) {
-           found = 1;
-           housekasa_device_set (i, state, pulse, cause);
-       }
+        if (!housekasa_device_owned(i)) continue;
+        if (strcmp (point, housekasa_device_name(i)) == 0)
+            return housekasa_inventory (i);
     }
+    echttp_error (404, "invalid point name");
+    return "";
+}
 
-    if (! found) {
-        echttp_error (404, "invalid point name");
+static const char *housekasa_devices (const char *method, const char *uri,
+                                      const char *data, int length) {
+    return housekasa_inventory (-1);
+}
+
+static const char *housekasa_profile (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    static char buffer[65537];
+    const char *error = housekasa_profile_export (buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
         return "";
     }
-    return housekasa_status (method, uri, data, length);
+    echttp_content_type_json ();
+    return buffer;
 }
 
 static const char *housekasa_config (const char *method, const char *uri,
@@ -157,9 +454,25 @@ static const char *housekasa_config (const char *method, const char *uri,
 
     if (strcmp ("GET", method) == 0) {
         static char buffer[65537];
+        char etag[64];
         housekasa_device_live_config (buffer, sizeof(buffer));
+
+        // The configuration has no version: use a hash of its content.
+        unsigned long long hash = 14695981039346656037ULL; // FNV-1a.
+        const char *p;
+        for (p = buffer; *p; ++p) {
+            hash ^= (unsigned char)(*p);
+            hash *= 1099511628211ULL;
+        }
+        snprintf (etag, sizeof(etag), "W/\"c%llx\"", hash);
+        if (housekasa_encoding_unmodified (etag)) {
+            echttp_error (304, "Not Modified");
+            return "";
+        }
+        if (!housekasa_encoding_current (ConfigCache, (long long)hash))
+            housekasa_encoding_store (ConfigCache, (long long)hash, buffer);
         echttp_content_type_json ();
-        return buffer;
+        return housekasa_encoding_reply (ConfigCache);
     }
 
     if (strcmp ("POST", method) == 0) {
@@ -176,21 +489,36 @@ static const char *housekasa_config (const char *method, const char *uri,
     return "";
 }
 
+static const char *housekasa_asset (const char *method, const char *uri,
+                                    const char *data, int length) {
+    return housekasa_encoding_asset (KasaPublic, uri);
+}
+
 static void housekasa_background (int fd, int mode) {
 
     time_t now = time(0);
 
+    housekasa_profile_start ();
     houseportal_background (now);
+    housekasa_profile_stage (ProfilePortal);
     housekasa_device_periodic(now);
+    housekasa_profile_stage (ProfileDevice);
     if (housekasa_device_changed() && houseconfig_active()) {
         static char buffer[65537];
         housekasa_device_live_config (buffer, sizeof(buffer));
         houseconfig_save (buffer, "AUTODETECT");
     }
+    housekasa_profile_stage (ProfileSave);
     housediscover (now);
+    if (housekasa_shard_background (now)) housestate_changed (LiveState);
+    housekasa_profile_stage (ProfileDiscover);
     houselog_background (now);
+    housekasa_profile_stage (ProfileLog);
     houseconfig_background (now);
+    housekasa_profile_stage (ProfileConfig);
     housedepositor_periodic (now);
+    housekasa_profile_stage (ProfileDepositor);
+    housekasa_profile_end ();
 }
 
 static void housekasa_protect (const char *method, const char *uri) {
@@ -213,15 +541,18 @@ int main (int argc, const char **argv) {
     echttp_default ("-http-service=dynamic");
 
     argc = echttp_open (argc, argv);
+    housekasa_shard_initialize (argc, argv, echttp_port(4));
     if (echttp_dynamic_port()) {
-        static const char *path[] = {"control:/kasa"};
+        static const char *path[] = {"control:/kasa", "kasa:/kasa"};
         houseportal_initialize (argc, argv);
-        houseportal_declare (echttp_port(4), path, 1);
+        houseportal_declare (echttp_port(4), path,
+                             housekasa_shard_enabled() ? 2 : 1);
     }
     housediscover_initialize (argc, argv);
     houselog_initialize ("kasa", argc, argv);
     housedepositor_initialize (argc, argv);
 
+    housekasa_resolve_initialize (argc, argv);
     error = houseconfig_initialize ("kasa", housekasa_device_refresh, argc, argv);
     if (error) {
         houselog_trace
@@ -230,6 +561,24 @@ int main (int argc, const char **argv) {
 
     LiveState = housestate_declare ("live");
 
+    housekasa_profile_initialize (argc, argv);
+    ProfilePortal = housekasa_profile_declare ("portal");
+    ProfileDevice = housekasa_profile_declare ("device");
+    ProfileSave = housekasa_profile_declare ("save");
+    ProfileDiscover = housekasa_profile_declare ("discover");
+    ProfileLog = housekasa_profile_declare ("log");
+    ProfileConfig = housekasa_profile_declare ("config");
+    ProfileDepositor = housekasa_profile_declare ("depositor");
+
+    housekasa_replay_initialize (argc, argv);
+
+    error = housekasa_timer_initialize ();
+    if (error) {
+        houselog_trace
+            (HOUSE_FAILURE, "TIMER", "Cannot initialize: %s\n", error);
+        exit(1);
+    }
+
     error = housekasa_device_initialize (argc, argv, LiveState);
     if (error) {
         houselog_trace
@@ -237,15 +586,30 @@ int main (int argc, const char **argv) {
         exit(1);
     }
 
+    // In replay mode, process the capture file and stop.
+    if (housekasa_replay_active()) exit (housekasa_replay_run ());
+
     echttp_cors_allow_method("GET");
     echttp_protect (0, housekasa_protect);
 
     echttp_route_uri ("/kasa/status", housekasa_status);
     echttp_route_uri ("/kasa/set",    housekasa_set);
+    echttp_route_uri ("/kasa/device", housekasa_device);
+    echttp_route_uri ("/kasa/devices", housekasa_devices);
 
     echttp_route_uri ("/kasa/config", housekasa_config);
+    echttp_route_uri ("/kasa/metrics", housekasa_metrics);
+    echttp_route_uri ("/kasa/profile", housekasa_profile);
+
+    StatusCache = housekasa_encoding_declare ();
+    ConfigCache = housekasa_encoding_declare ();
+
+    // The web UI pages are served with their precompressed copies.
+    echttp_route_uri ("/kasa/index.html", housekasa_asset);
+    echttp_route_uri ("/kasa/config.html", housekasa_asset);
+    echttp_route_uri ("/kasa/events.html", housekasa_asset);
 
-    echttp_static_route ("/", "/usr/local/share/house/public");
+    echttp_static_route ("/", KasaPublic);
     echttp_background (&housekasa_background);
     houselog_event ("SERVICE", "kasa", "STARTED", "ON %s", houselog_host());
     echttp_loop();
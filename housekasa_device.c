@@ -25,7 +25,11 @@
  * const char *housekasa_device_initialize
  *                 (int argc, const char **argv, int livestate);
  *
- *    Initialize this module at startup.
+ *    Initialize this module at startup. The last known address and state
+ *    of each device are loaded from the snapshot file (option
+ *    -kasa-snapshot=PATH, default /var/lib/house/kasa.snapshot) and
+ *    all known addresses are queried immediately. The snapshot is written
+ *    again every minute when something changed.
  *
  * int housekasa_device_changed (void);
  *
@@ -37,6 +41,14 @@
  *    Recover the current live config, typically to save it to disk after
  *    a change has been detected.
  *
+ * const char *housekasa_device_inventory (int point, char *buffer, int size);
+ *
+ *    Format the details last reported by one device (firmware, MAC
+ *    address, signal strength, etc.), or by all devices owned by this
+ *    instance if point is -1, as a JSON document. This is served from
+ *    memory: nothing is sent to the devices. Return an error message,
+ *    or a null pointer on success.
+ *
  * const char *housekasa_device_refresh (void);
  *
  *    Re-evaluate the configuration after it changed.
@@ -53,6 +65,17 @@
  *
  *    Return a string describing the failure, or a null pointer if healthy.
  *
+ * int housekasa_device_owned (int point);
+ *
+ *    Return 1 if this device belongs to this instance (see
+ *    housekasa_shard.c). The devices that belong to another instance are
+ *    neither polled nor controlled, and their responses are ignored.
+ *
+ * int housekasa_device_stale (int point);
+ *
+ *    Return 1 if the state of the device was loaded from the snapshot
+ *    at startup, and the device has not confirmed it yet.
+ *
  * int    housekasa_device_commanded (int point);
  * time_t housekasa_device_deadline (int point);
  * int    housekasa_device_priority (int point);
@@ -64,6 +87,30 @@
  *
  *    Get the actual state of the device.
  *
+ * int housekasa_device_brightness (int point);
+ *
+ *    Get the brightness level of a dimmer (1 to 100), or -1 if this
+ *    device is not a dimmer.
+ *
+ * int housekasa_device_set_brightness (int point, int level,
+ *                                      const char *cause);
+ *
+ *    Set the brightness of a dimmer. Only one brightness command is in
+ *    flight for a device at any time: a request received while a command
+ *    is in flight replaces any previous pending value, and is sent once
+ *    the device acknowledged the previous command. This way a slider
+ *    does not flood the device, and the final value is applied quickly.
+ *
+ *    Return 1 on success, 0 if this device is not a dimmer or was not
+ *    detected yet.
+ *
+ * int housekasa_device_rtt (int point);
+ * int housekasa_device_age (int point);
+ *
+ *    Return the smoothed round trip time of the device (milliseconds),
+ *    or the time since the device last responded (seconds). Return -1
+ *    if there is no data available.
+ *
  * void housekasa_device_set (int point, int state,
  *                           int pulse, const char *cause);
  *
@@ -71,12 +118,37 @@
  *    length specified. The pulse length is in seconds. If pulse is 0, the
  *    device is maintained to the requested state until a new state is issued.
  *
+ *    The end of a pulse is also programmed in the device itself, as a
+ *    count_down rule sent with the control, when the model supports it:
+ *    the device turns itself off even if HouseKasa cannot reach it at
+ *    that time. The server side deadline is then only used to verify
+ *    that the device did turn off, and to turn it off otherwise. The
+ *    device may turn off up to one second early, since the count_down
+ *    delay is in seconds.
+ *
+ *    Only one command is in flight for a device (i.e. an IP address) at
+ *    any time: a command issued while another is in flight is queued, and
+ *    sent once the previous one was acknowledged or abandoned. A newer
+ *    command for the same point replaces the one queued.
+ *
  *    Return 1 on success, 0 if the device is not known and -1 on error.
  *
+ * void housekasa_device_batch_start (void);
+ * void housekasa_device_batch_flush (void);
+ *
+ *    Group the controls issued between these two calls, typically a scene.
+ *    The controls are sent when the batch is flushed, one datagram per
+ *    device: the outlets of a multi-outlet device that are set to the same
+ *    state are controlled together, using a list of child IDs.
+ *
  * void housekasa_device_periodic (void);
  *
  *    This function must be called every second. It runs the Kasa device
- *    discovery and ends the expired pulses.
+ *    discovery (spread over time if the socket buffer overflowed), polls
+ *    the devices not heard from recently (within the -kasa-poll-rate=N
+ *    budget, in polls per second) and detects silent devices. The end of
+ *    pulses and the command retries are scheduled using the
+ *    housekasa_timer module.
  */
 
 #include <time.h>
@@ -85,7 +157,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <netpacket/packet.h>
@@ -93,6 +169,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "echttp.h"
 #include "echttp_json.h"
@@ -102,6 +180,13 @@
 #include "houseconfig.h"
 #include "housestate.h"
 
+#include "housekasa_io.h"
+#include "housekasa_metrics.h"
+#include "housekasa_model.h"
+#include "housekasa_replay.h"
+#include "housekasa_resolve.h"
+#include "housekasa_shard.h"
+#include "housekasa_timer.h"
 #include "housekasa_device.h"
 
 
@@ -112,20 +197,84 @@
 //
 #define WIZ_ID_OFFSET 12000
 
+// The events that a faulty device or network may repeat at a high rate.
+// Each device has a token bucket per event type: the events in excess
+// are only counted, and reported later as one summary event.
+//
+#define KASA_EVENT_RETRY    0
+#define KASA_EVENT_CHANGED  1
+#define KASA_EVENT_SILENT   2
+#define KASA_EVENT_DETECTED 3
+#define KASA_EVENT_TYPES    4
+
+static const char *KasaEventNames[KASA_EVENT_TYPES] = {
+    "RETRY", "CHANGED", "SILENT", "DETECTED"
+};
+
+#define KASA_EVENT_BURST      5 // Events.
+#define KASA_EVENT_REFILL 12000 // ms per event, i.e. 5 events per minute.
+#define KASA_EVENT_SUMMARY 60000 // ms: how often the summary is reported.
+
+struct DeviceEvents {
+    int tokens;
+    int suppressed;
+    long long refill;
+    long long since; // When the first event was suppressed.
+};
+
+// The details reported by the device that are not needed for control,
+// kept for inventory purposes. These are only updated when a reply is
+// decoded, i.e. when its fingerprint changed, except for the signal
+// strength which is retrieved while computing the fingerprint.
+//
+struct DeviceInfo {
+    char sw_ver[48];
+    char hw_ver[16];
+    char mac[18];
+    int rssi;        // dBm, 0 if not known.
+    int led_off;     // -1 if not known.
+    int on_time;     // Seconds, at the time of the latest decoded reply.
+    long long updated; // When the latest reply was decoded (ms).
+};
+
 struct DeviceMap {
     char *name;
     char *model;
+    int kind;        // Index in the model capability table.
+    int features;    // KASA_MODEL_* flags supported by this device.
     char *id;
     char *child;
     char *description;
+    char *host;      // Configured address, may be a host name.
     struct sockaddr_in ipaddress;
-    time_t detected;
+    int ifindex;
+    long long detected;   // All times are from the monotonic clock, in ms.
     int status;
     int commanded;
     int priority;
-    time_t pending;  // Deadline for retrying the latest control.
-    time_t deadline; // When the device will timeout and be turned off.
-    time_t last_sense;
+    long long pending;  // Deadline for retrying the latest control.
+    long long deadline; // When the device will timeout and be turned off.
+    long long last_sense;
+    long long changed; // When the device status last changed (ms).
+    long long sent;  // When the latest control was sent (ms).
+    long long retry; // When the latest control must be resent (ms).
+    int retries;
+    int srtt;        // Smoothed round trip time (ms).
+    int rttvar;      // Round trip time variation (ms).
+    int rto;         // Retransmission timeout (ms).
+    int brightness;  // Dimmers only, -1 otherwise.
+    int dim_sent;    // Brightness command in flight, -1 if none.
+    int dim_wanted;  // Latest brightness requested, -1 if none.
+    int dim_retries;
+    long long dim_expires;
+    int batched;     // A control is waiting for the batch to be flushed.
+    int inflight;    // A control was sent and not yet acknowledged.
+    int queued;      // A control waits for the device to be available.
+    int countdown;   // State of the count_down rule in the device.
+    unsigned long long fingerprint; // Of the latest status reply, 0 if none.
+    int stale;       // State loaded from the snapshot, not yet confirmed.
+    struct DeviceEvents events[KASA_EVENT_TYPES];
+    struct DeviceInfo info;
 };
 
 static int DeviceListChanged = 0;
@@ -135,19 +284,107 @@ static int DevicesCount = 0;
 static int DevicesSpace = 0;
 
 static int KasaDevicePort = 9999;
-static int KasaSocket = -1;
-
-#define KASASENSEMAX 64
 
+// The list of networks where to send discovery broadcasts. The first entry
+// is always the limited broadcast, followed by the networks listed in the
+// configuration (these have a name), followed by the directed broadcast
+// addresses of the local interfaces (these have an interface name).
+//
 struct NetworkMap {
     char *name;
+    char *ifname;
+    int ifindex;
+    struct in_addr local;
+    struct in_addr netmask;
     struct sockaddr_in addr;
 };
 static int KasaSenseCount = 0;
-static struct NetworkMap KasaSense[KASASENSEMAX];
+static int KasaSenseSpace = 0;
+static struct NetworkMap *KasaSense = 0;
+
+static int KasaInterfaceWatch = -1;
 
 static int LiveState = 0;
 
+static int KasaBatch = 0; // Controls are queued until the batch is flushed.
+
+// The snapshot is a compact binary file that keeps the last known address
+// and state of each device across restarts: a header followed by one
+// fixed size record per device. It is not meant to be portable.
+//
+#define KASA_SNAPSHOT_MAGIC   "KASASNP1"
+#define KASA_SNAPSHOT_PERIOD  60000  // ms
+#define KASA_SNAPSHOT_STALE  100000  // ms: how long a stale state is shown.
+
+struct SnapshotHeader {
+    char magic[8];
+    int32_t count;
+    int32_t size; // Of each record, for consistency checking.
+};
+
+struct SnapshotRecord {
+    char id[64];
+    char child[64];
+    uint32_t address; // Network byte order.
+    int16_t brightness;
+    uint8_t status;
+    uint8_t reserved;
+};
+
+static const char *KasaSnapshotPath = "/var/lib/house/kasa.snapshot";
+static char *KasaSnapshotLatest = 0; // Latest content written.
+static int KasaSnapshotLatestSize = 0;
+static long long KasaSnapshotLoaded = 0;
+
+// Command retries are driven by a precise timer, with a retransmission
+// timeout adapted to each device from its measured round trip time,
+// in the way of TCP (see RFC 6298).
+//
+#define KASA_RTO_INITIAL 300 // ms
+#define KASA_RTO_MIN     200 // ms
+#define KASA_RTO_MAX    2000 // ms
+
+#define KASA_PENDING    5000 // ms: how long a command is retried.
+
+// A device is polled only if it was not heard from recently: the
+// discovery broadcasts already refresh most devices. The devices with
+// a pending command, or which status changed recently, are polled more
+// often. The total rate of polls is limited, so that a large fleet does
+// not flood the network: the excess polls are delayed.
+//
+#define KASA_POLL_IDLE   35000 // ms since the device was last heard.
+#define KASA_POLL_ACTIVE  5000 // ms, while a device is active.
+#define KASA_ACTIVE      60000 // ms: how long a change makes a device active.
+
+// A discovery broadcast causes a burst of replies, one per device.
+// If the kernel drops replies, the discovery is spread over time:
+// first one network per second, then by sweeping the local subnets
+// with unicast requests. The discovery returns to the previous mode
+// after a calm period without drops.
+//
+#define KASA_DISCOVERY_BROADCAST 0 // All networks at once.
+#define KASA_DISCOVERY_STAGED    1 // One network per second.
+#define KASA_DISCOVERY_UNICAST   2 // One address at a time, when possible.
+
+#define KASA_DISCOVERY_PERIOD  60000 // ms
+#define KASA_DISCOVERY_CALM   600000 // ms without drops before relaxing.
+
+#define KASA_SWEEP_MAX  1024 // Largest subnet swept, in addresses.
+#define KASA_SWEEP_RATE   50 // Addresses per second.
+
+static const char *KasaDiscoveryNames[] = {"BROADCAST", "STAGED", "UNICAST"};
+
+static int KasaDiscoveryMode = KASA_DISCOVERY_BROADCAST;
+static long long KasaDiscoveryChanged = 0;
+static long long KasaDiscoveryDropped = 0; // Last time replies were dropped.
+static int KasaDiscoveryNext = -1; // Next network to discover, -1 if done.
+static unsigned int KasaSweepNext = 0; // Next host in the swept subnet.
+
+static int KasaPollRate = 20; // Polls per second.
+static int KasaPollTokens = 0;
+static long long KasaPollRefill = 0;
+static int KasaPollCursor = 0;
+
 int housekasa_device_count (void) {
     return DevicesCount;
 }
@@ -174,7 +411,12 @@ int housekasa_device_commanded (int point) {
 
 time_t housekasa_device_deadline (int point) {
     if (point < 0 || point > DevicesCount) return 0;
-    return Devices[point].deadline;
+    if (!Devices[point].deadline) return 0;
+
+    // The web API uses the wall clock time.
+    long long remaining = Devices[point].deadline - housekasa_timer_now();
+    if (remaining < 0) remaining = 0;
+    return time(0) + (time_t)((remaining + 999) / 1000);
 }
 
 int housekasa_device_priority (int point) {
@@ -184,15 +426,42 @@ int housekasa_device_priority (int point) {
 
 const char *housekasa_device_failure (int point) {
     if (point < 0 || point > DevicesCount) return 0;
-    if (!Devices[point].detected) return "silent";
+    if ((!Devices[point].detected) && (!Devices[point].stale)) return "silent";
     return 0;
 }
 
+int housekasa_device_owned (int point) {
+    if (point < 0 || point > DevicesCount) return 0;
+    return housekasa_shard_owned (Devices[point].id);
+}
+
+int housekasa_device_stale (int point) {
+    if (point < 0 || point > DevicesCount) return 0;
+    return Devices[point].stale;
+}
+
 int housekasa_device_get (int point) {
     if (point < 0 || point > DevicesCount) return 0;
     return Devices[point].status;
 }
 
+int housekasa_device_brightness (int point) {
+    if (point < 0 || point > DevicesCount) return -1;
+    return Devices[point].brightness;
+}
+
+int housekasa_device_rtt (int point) {
+    if (point < 0 || point >= DevicesCount) return -1;
+    if (!Devices[point].srtt) return -1;
+    return Devices[point].srtt;
+}
+
+int housekasa_device_age (int point) {
+    if (point < 0 || point >= DevicesCount) return -1;
+    if (!Devices[point].detected) return -1;
+    return (int)((housekasa_timer_now() - Devices[point].detected) / 1000);
+}
+
 static int housekasa_device_id_search (const char *id, const char *child) {
     int i;
     for (i = 0; i < DevicesCount; ++i) {
@@ -206,74 +475,442 @@ static int housekasa_device_id_search (const char *id, const char *child) {
     return -1;
 }
 
-static void housekasa_device_socket (void) {
+// Return 1 if this event may be logged now. Call this before formatting
+// the event, so that no time is spent on events that are not logged.
+//
+static int housekasa_device_event_allowed (int device, int type) {
+
+    struct DeviceEvents *bucket = Devices[device].events + type;
+    long long now = housekasa_timer_now();
+
+    long long earned = (now - bucket->refill) / KASA_EVENT_REFILL;
+    if (earned > 0) {
+        if (earned > KASA_EVENT_BURST) earned = KASA_EVENT_BURST;
+        bucket->tokens += (int)earned;
+        bucket->refill += earned * KASA_EVENT_REFILL;
+        if (bucket->tokens >= KASA_EVENT_BURST) {
+            bucket->tokens = KASA_EVENT_BURST;
+            bucket->refill = now;
+        }
+    }
+    if (bucket->tokens > 0) {
+        bucket->tokens -= 1;
+        return 1;
+    }
+    if (!bucket->suppressed) bucket->since = now;
+    bucket->suppressed += 1;
+    return 0;
+}
+
+// Report the events that were suppressed, as one event per type.
+//
+static void housekasa_device_event_summary (int device, long long now) {
+    int type;
+    for (type = 0; type < KASA_EVENT_TYPES; ++type) {
+        struct DeviceEvents *bucket = Devices[device].events + type;
+        if (!bucket->suppressed) continue;
+        if (now < bucket->since + KASA_EVENT_SUMMARY) continue;
+        houselog_event ("DEVICE", Devices[device].name, KasaEventNames[type],
+                        "x%d IN %llds", bucket->suppressed,
+                        (now - bucket->since) / 1000);
+        bucket->suppressed = 0;
+    }
+}
+
+static void housekasa_device_send (const struct sockaddr_in *a, const char *d) {
+    housekasa_io_send (a, d);
+}
+
+static void housekasa_device_sense (const struct sockaddr_in *a) {
+    housekasa_device_send (a, "{\"system\":{\"get_sysinfo\":{}}}");
+}
 
-    KasaSense[0].name = 0;
-    KasaSense[0].addr.sin_family = AF_INET;
-    KasaSense[0].addr.sin_port = htons(KasaDevicePort);
-    KasaSense[0].addr.sin_addr.s_addr = INADDR_BROADCAST;
-    KasaSenseCount = 1;
+// Most devices accept a get_sysinfo request in the same datagram as
+// the control, which gives the new state in the response. The models
+// which firmware rejects this combined request are listed here, once
+// detected: these fall back to a separate get_sysinfo request after
+// the control was acknowledged.
+//
+#define KASASEPARATEMAX 16
+static char *KasaSeparateModels[KASASEPARATEMAX];
+static int KasaSeparateCount = 0;
 
-    KasaSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (KasaSocket < 0) {
-        houselog_trace (HOUSE_FAILURE, "DEVICE",
-                        "cannot open UDP socket: %s", strerror(errno));
-        exit(1);
+// The count_down rule that turns a device off at the end of a pulse.
+// The firmware runs it on its own: the server only checks the outcome.
+// Models without a count_down module are listed once detected.
+//
+#define KASA_COUNTDOWN_NONE 0
+#define KASA_COUNTDOWN_SENT 1 // Sent with the control, not acknowledged.
+#define KASA_COUNTDOWN_SET  2 // The device accepted the rule.
+
+#define KASA_COUNTDOWN_GRACE 1500 // ms: when to check the device is off.
+
+#define KASANOCOUNTDOWNMAX 16
+static char *KasaNoCountdownModels[KASANOCOUNTDOWNMAX];
+static int KasaNoCountdownCount = 0;
+
+// Resolve the model of a device to its entry in the capability table,
+// once: the protocol code then only tests the device's features.
+// The features that were found missing for this model are removed.
+//
+static void housekasa_device_model_resolve (int device) {
+    int i;
+    const char *model = Devices[device].model;
+    Devices[device].kind = housekasa_model_search (model);
+    Devices[device].features = housekasa_model_features (Devices[device].kind);
+    if (!model) {
+        // Not known yet: do not risk it.
+        Devices[device].features &= ~KASA_MODEL_COUNTDOWN;
+        return;
+    }
+    for (i = 0; i < KasaSeparateCount; ++i) {
+        if (!strcmp (model, KasaSeparateModels[i]))
+            Devices[device].features &= ~KASA_MODEL_COMBINED;
+    }
+    for (i = 0; i < KasaNoCountdownCount; ++i) {
+        if (!strcmp (model, KasaNoCountdownModels[i]))
+            Devices[device].features &= ~KASA_MODEL_COUNTDOWN;
     }
+}
 
-    int value = 1;
-    if (setsockopt(KasaSocket, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
-        houselog_trace (HOUSE_FAILURE, "SOCKET",
-                        "cannot broadcast: %s", strerror(errno));
-        exit(1);
+// Record that a model does not support a feature, and remove that
+// feature from all the devices of that model.
+//
+static void housekasa_device_model_lacks (int device, int feature,
+                                          char **list, int *count, int max) {
+    int i;
+    const char *model = Devices[device].model;
+    if (!model) {
+        Devices[device].features &= ~feature;
+        return;
     }
+    if (*count < max) list[(*count)++] = strdup(model);
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!Devices[i].model) continue;
+        if (strcmp (model, Devices[i].model)) continue;
+        Devices[i].features &= ~feature;
+    }
+}
 
-    houselog_trace (HOUSE_INFO, "DEVICE", "UDP port %d is now open", KasaDevicePort);
+static int housekasa_device_combined (int device) {
+    return (Devices[device].features & KASA_MODEL_COMBINED) != 0;
 }
 
-static void housekasa_device_send (const struct sockaddr_in *a, const char *d) {
-    if (echttp_isdebug()) {
-        long ip = ntohl((long)(a->sin_addr.s_addr));
-        int port = ntohs(a->sin_port);
-        printf ("Sending packet to %ld.%ld.%ld.%ld(port %d): %s\n",
-                (ip>>24)&0xff, (ip>>16)&0xff, (ip>>8)&0xff, ip&0xff, port, d);
+static void housekasa_device_separate (int device) {
+    if (!housekasa_device_combined (device)) return;
+    housekasa_device_model_lacks (device, KASA_MODEL_COMBINED,
+                                  KasaSeparateModels, &KasaSeparateCount,
+                                  KASASEPARATEMAX);
+    if (Devices[device].model)
+        houselog_event ("MODEL", Devices[device].model, "SEPARATE",
+                        "COMBINED CONTROL AND STATUS NOT SUPPORTED");
+}
+
+static int housekasa_device_countdown_supported (int device) {
+    return (Devices[device].features & KASA_MODEL_COUNTDOWN) != 0;
+}
+
+static void housekasa_device_countdown_unsupported (int device) {
+    if (!housekasa_device_countdown_supported (device)) return;
+    housekasa_device_model_lacks (device, KASA_MODEL_COUNTDOWN,
+                                  KasaNoCountdownModels, &KasaNoCountdownCount,
+                                  KASANOCOUNTDOWNMAX);
+    if (Devices[device].model)
+        houselog_event ("MODEL", Devices[device].model,
+                        "COUNTDOWN", "NOT SUPPORTED");
+}
+
+// Return the count_down request to add to a control, or an empty string
+// if none is needed. A rule is programmed when the device is turned on
+// for a pulse, and removed when the device is controlled otherwise, so
+// that an obsolete rule does not turn the device off later.
+//
+static const char *housekasa_device_countdown (int device, int state,
+                                               char *buffer, int size) {
+    if (state && Devices[device].deadline &&
+        housekasa_device_countdown_supported (device)) {
+        // Round down: the device must be off when the deadline is checked.
+        long long remaining = Devices[device].deadline - housekasa_timer_now();
+        int delay = (remaining > 1000) ? (int)(remaining / 1000) : 1;
+        snprintf (buffer, size,
+                  ",\"count_down\":{\"delete_all_rules\":{},\"add_rule\":{\"enable\":1,\"delay\":%d,\"act\":0,\"name\":\"housekasa\"}}",
+                  delay);
+        Devices[device].countdown = KASA_COUNTDOWN_SENT;
+        return buffer;
+    }
+    if (Devices[device].countdown != KASA_COUNTDOWN_NONE) {
+        Devices[device].countdown = KASA_COUNTDOWN_NONE;
+        return ",\"count_down\":{\"delete_all_rules\":{}}";
     }
+    return "";
+}
+
+static void housekasa_device_control (int device, int state) {
+    char buffer[512];
+    char rule[160];
+    const char *child = Devices[device].child;
+    const char *countdown =
+        housekasa_device_countdown (device, state, rule, sizeof(rule));
+    if (housekasa_model_control (Devices[device].kind, buffer, sizeof(buffer),
+                                 Devices[device].id,
+                                 &child, (child && child[0]) ? 1 : 0,
+                                 state, housekasa_device_combined (device),
+                                 countdown))
+        housekasa_device_send (&(Devices[device].ipaddress), buffer);
+    else
+        houselog_trace (HOUSE_FAILURE, "DEVICE",
+                        "%s: control request too large", Devices[device].name);
+}
+
+// Control several outlets of the same multi-outlet device at once.
+// A batch with more outlets is split in several requests, so that
+// each request fits in one datagram.
+//
+#define KASA_OUTLETS_PER_REQUEST 16
+
+static void housekasa_device_control_children (const int *list, int count,
+                                               int state) {
+    char buffer[1400];
+    const char *children[KASA_OUTLETS_PER_REQUEST];
+    int i;
+    int device = list[0];
+
+    for (i = 0; i < count; ++i) children[i] = Devices[list[i]].child;
+
+    if (housekasa_model_control (Devices[device].kind, buffer, sizeof(buffer),
+                                 Devices[device].id, children, count, state,
+                                 housekasa_device_combined (device), ""))
+        housekasa_device_send (&(Devices[device].ipaddress), buffer);
+    else
+        houselog_trace (HOUSE_FAILURE, "DEVICE",
+                        "%s: control request too large for %d outlets",
+                        Devices[device].name, count);
+}
+
+static void housekasa_device_timer (int device);
+
+static void housekasa_device_schedule (int device, long long deadline) {
+    housekasa_timer_schedule (deadline, housekasa_device_timer, device);
+}
+
+// Schedule the first retry of the command just sent.
+//
+static void housekasa_device_arm (int device) {
+
+    long long now = housekasa_timer_now();
+
+    if (!Devices[device].rto) Devices[device].rto = KASA_RTO_INITIAL;
+    Devices[device].sent = now;
+    Devices[device].retries = 0;
+    Devices[device].retry = now + Devices[device].rto;
+    housekasa_device_schedule (device, Devices[device].retry);
+}
+
+// Return 1 if a command is in flight for the physical device, i.e.
+// for any point using the same address.
+//
+static int housekasa_device_busy (int device) {
     int i;
-    char encoded[1500];
-    char key = 0xab;
-    int length = strlen(d);
-    if (length > sizeof(encoded)) {
-        houselog_trace (HOUSE_FAILURE, "INTERNAL",
-                        "Encoding buffer too small: has %d, needs %d",
-                        sizeof(encoded), length);
+    in_addr_t address = Devices[device].ipaddress.sin_addr.s_addr;
+    if (!address) return 0;
+    for (i = 0; i < DevicesCount; ++i) {
+        if (Devices[i].inflight &&
+            (Devices[i].ipaddress.sin_addr.s_addr == address)) return 1;
+    }
+    return 0;
+}
+
+static void housekasa_device_queue (int device) {
+    if (Devices[device].queued)
+        housekasa_metrics_increment (KASA_METRIC_SUPERSEDED);
+    Devices[device].queued = 1;
+}
+
+// Send the current command to the device, and schedule its first retry.
+//
+static void housekasa_device_transmit (int device) {
+
+    // In batch mode, the command is sent when the batch is flushed.
+    //
+    if (KasaBatch) {
+        Devices[device].batched = 1;
         return;
     }
-    for (i = 0; i < length; ++i) {
-        key = encoded[i] = key ^ d[i];
+    if (housekasa_device_busy (device)) {
+        housekasa_device_queue (device);
+        return;
+    }
+
+    // Only send a command if we detected the device on the network.
+    //
+    Devices[device].queued = 0;
+    if (Devices[device].detected) {
+        housekasa_device_control (device, Devices[device].commanded);
+        Devices[device].inflight = 1;
     }
-    int sent = sendto (KasaSocket, encoded, length, 0,
-                       (struct sockaddr *)a, sizeof(struct sockaddr_in));
-    if (sent < 0)
-        houselog_trace
-            (HOUSE_FAILURE, "DEVICE", "sendto() error: %s", strerror(errno));
+    housekasa_device_arm (device);
 }
 
-static void housekasa_device_sense (const struct sockaddr_in *a) {
-    housekasa_device_send (a, "{\"system\":{\"get_sysinfo\":{}}}");
+// Send a queued command, if still needed. Return 1 if something was sent.
+//
+static int housekasa_device_dispatch (int device) {
+
+    Devices[device].queued = 0;
+    if (Devices[device].status == Devices[device].commanded) {
+        Devices[device].pending = 0; // Already there.
+        return 0;
+    }
+    // The command is retried for the full period from now on.
+    if (Devices[device].pending)
+        Devices[device].pending = housekasa_timer_now() + KASA_PENDING;
+    housekasa_device_transmit (device);
+    return Devices[device].inflight;
 }
 
-static void housekasa_device_control (int device, int state) {
-    char buffer[256];
-    if (Devices[device].child && Devices[device].child[0]) {
-        snprintf (buffer, sizeof(buffer),
-              "{\"context\":{\"child_ids\":[\"%s%s\"]},\"system\":{\"set_relay_state\":{\"state\":%c}}}",
-              Devices[device].id, Devices[device].child, state?'1':'0');
+// The command in flight for this address completed: send the next one.
+//
+static void housekasa_device_advance (in_addr_t address) {
+    int i;
+    for (i = 0; i < DevicesCount; ++i) {
+        if (Devices[i].ipaddress.sin_addr.s_addr != address) continue;
+        Devices[i].inflight = 0;
+    }
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!Devices[i].queued) continue;
+        if (Devices[i].ipaddress.sin_addr.s_addr != address) continue;
+        if (housekasa_device_dispatch (i)) break; // One at a time.
+    }
+}
+
+// Return 1 if a command in flight at this address reached its commanded
+// state. A duplicate acknowledgement of a retried command must not release
+// the command dispatched next.
+//
+static int housekasa_device_acknowledged (in_addr_t address) {
+    int i;
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!Devices[i].inflight) continue;
+        if (Devices[i].ipaddress.sin_addr.s_addr != address) continue;
+        if (Devices[i].status == Devices[i].commanded) return 1;
+    }
+    return 0;
+}
+
+static void housekasa_device_rtt_update (int device) {
+
+    // Ignore the ambiguous samples (Karn's algorithm).
+    if (Devices[device].retries || !Devices[device].sent) return;
+
+    int rtt = (int)(housekasa_timer_now() - Devices[device].sent);
+    if (Devices[device].srtt) {
+        int delta = Devices[device].srtt - rtt;
+        if (delta < 0) delta = 0 - delta;
+        Devices[device].rttvar = (3 * Devices[device].rttvar + delta) / 4;
+        Devices[device].srtt = (7 * Devices[device].srtt + rtt) / 8;
     } else {
-        snprintf (buffer, sizeof(buffer),
-              "{\"system\":{\"set_relay_state\":{\"state\":%c}}}",
-              state?'1':'0');
+        Devices[device].srtt = rtt;
+        Devices[device].rttvar = rtt / 2;
+    }
+    int rto = Devices[device].srtt + 4 * Devices[device].rttvar;
+    if (rto < KASA_RTO_MIN) rto = KASA_RTO_MIN;
+    else if (rto > KASA_RTO_MAX) rto = KASA_RTO_MAX;
+    Devices[device].rto = rto;
+}
+
+static void housekasa_device_dim_send (int device, int level) {
+
+    char buffer[256];
+    long long now = housekasa_timer_now();
+
+    int combined = housekasa_device_combined (device);
+    int kind = Devices[device].kind;
+
+    // The device reported a brightness, even though its model is not
+    // known as a dimmer: use the generic dimmer request.
+    if (!(Devices[device].features & KASA_MODEL_DIMMER)) kind = 0;
+
+    if (!housekasa_model_brightness (kind, buffer, sizeof(buffer),
+                                     level, combined)) {
+        Devices[device].dim_sent = Devices[device].dim_wanted = -1;
+        return;
     }
     housekasa_device_send (&(Devices[device].ipaddress), buffer);
+
+    int timeout = 2 * (Devices[device].rto ? Devices[device].rto : KASA_RTO_INITIAL);
+    Devices[device].dim_sent = level;
+    Devices[device].dim_expires = now + timeout;
+    housekasa_device_schedule (device, Devices[device].dim_expires);
+}
+
+int housekasa_device_set_brightness (int device, int level,
+                                     const char *cause) {
+
+    if (device < 0 || device >= DevicesCount) return 0;
+    if (Devices[device].brightness < 0) return 0;
+    if (!Devices[device].detected) return 0; // Nowhere to send it.
+
+    // The brightness has its own single command in flight, independent
+    // of the relay command queue: a dimmer is a single point device, and
+    // a brightness change must not wait for a relay retry to complete.
+    //
+
+
+    if (level < 1) level = 1;
+    else if (level > 100) level = 100;
+
+    if (echttp_isdebug())
+        fprintf (stderr, "set %s brightness to %d%s%s\n",
+                 Devices[device].name, level, cause?" ":"", cause?cause:"");
+
+    Devices[device].dim_retries = 0;
+    if (Devices[device].dim_sent >= 0) {
+        Devices[device].dim_wanted = level; // Supersede any pending value.
+        return 1;
+    }
+    Devices[device].dim_wanted = -1;
+    housekasa_device_dim_send (device, level);
+    return 1;
+}
+
+static void housekasa_device_dim_acknowledged (int device, int error) {
+
+    int sent = Devices[device].dim_sent;
+    if (sent < 0) return; // Nothing in flight.
+
+    Devices[device].dim_sent = -1;
+    if (error)
+        houselog_trace (HOUSE_FAILURE, Devices[device].name,
+                        "brightness %d rejected (error %d)", sent, error);
+
+    if (Devices[device].dim_wanted >= 0) {
+        int level = Devices[device].dim_wanted;
+        Devices[device].dim_wanted = -1;
+        housekasa_device_dim_send (device, level);
+    } else if (!error) {
+        houselog_event ("DEVICE", Devices[device].name,
+                        "BRIGHTNESS", "%d%%", sent);
+    }
+}
+
+static void housekasa_device_dim_timeout (int device, long long now) {
+
+    if (Devices[device].dim_sent < 0) return;
+    if (now < Devices[device].dim_expires) return;
+
+    // The latest value wins. If there was none, retry the lost one.
+    int level = Devices[device].dim_wanted;
+    if (level < 0) {
+        if (++Devices[device].dim_retries > 3) {
+            houselog_event ("DEVICE", Devices[device].name,
+                            "TIMEOUT", "BRIGHTNESS %d%%",
+                            Devices[device].dim_sent);
+            Devices[device].dim_sent = -1;
+            return;
+        }
+        level = Devices[device].dim_sent;
+    }
+    Devices[device].dim_wanted = -1;
+    housekasa_device_dim_send (device, level);
 }
 
 void housekasa_device_set (int device, int state,
@@ -282,7 +919,7 @@ void housekasa_device_set (int device, int state,
     if (device < 0 || device > DevicesCount) return;
 
     const char *namedstate = state?"on":"off";
-    time_t now = time(0);
+    long long now = housekasa_timer_now();
 
     // Manual controls have higher priority than others (schedule or event
     // based controls). The goal is to prevent an automatic control from
@@ -308,101 +945,549 @@ void housekasa_device_set (int device, int state,
             Devices[device].priority = priority;
     }
 
-    char comment[256];
-    if (cause)
-        snprintf (comment, sizeof(comment), " (%s)", cause);
-    else
-        comment[0] = 0;
+    char comment[256];
+    if (cause)
+        snprintf (comment, sizeof(comment), " (%s)", cause);
+    else
+        comment[0] = 0;
+
+    if (echttp_isdebug()) {
+        if (pulse) fprintf (stderr, "set %s to %s at %lld (pulse %ds)%s\n", Devices[device].name, namedstate, now, pulse, comment);
+        else       fprintf (stderr, "set %s to %s at %lld%s\n", Devices[device].name, namedstate, now, comment);
+    }
+
+    if (pulse > 0) {
+        // A new pulse can only extend a reset deadline, not shorten it.
+        long long deadline = now + (pulse * 1000LL);
+        if (deadline > Devices[device].deadline) {
+            Devices[device].deadline = deadline;
+            housekasa_device_schedule (device, deadline);
+            houselog_event ("DEVICE", Devices[device].name, "SET",
+                            "%s FOR %d SECONDS%s", namedstate, pulse, comment);
+        }
+    } else {
+        Devices[device].deadline = 0;
+        houselog_event ("DEVICE", Devices[device].name, "SET",
+                        "%s%s", namedstate, comment);
+    }
+    Devices[device].commanded = state;
+    Devices[device].pending = now + KASA_PENDING;
+    housestate_changed (LiveState); // The command is reported.
+    housekasa_device_transmit (device);
+}
+
+void housekasa_device_batch_start (void) {
+    KasaBatch = 1;
+}
+
+void housekasa_device_batch_flush (void) {
+
+    int i, j;
+    int list[KASA_OUTLETS_PER_REQUEST];
+
+    KasaBatch = 0;
+
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!Devices[i].batched) continue;
+        Devices[i].batched = 0;
+        if (housekasa_device_busy (i)) {
+            housekasa_device_queue (i);
+            continue;
+        }
+        Devices[i].queued = 0;
+        housekasa_device_arm (i);
+        if (!Devices[i].detected) continue;
+
+        int state = Devices[i].commanded;
+        Devices[i].inflight = 1;
+        if (!(Devices[i].child && Devices[i].child[0]) ||
+            Devices[i].deadline || Devices[i].countdown) {
+            // A count_down rule is specific to each outlet.
+            housekasa_device_control (i, state);
+            continue;
+        }
+
+        // Gather the other outlets of the same device set to the same state.
+        // Any outlet left is gathered in a later request.
+        int count = 0;
+        list[count++] = i;
+        for (j = i + 1; j < DevicesCount; ++j) {
+            if (count >= KASA_OUTLETS_PER_REQUEST) break;
+            if (!Devices[j].batched) continue;
+            if (!Devices[j].detected) continue;
+            if (Devices[j].commanded != state) continue;
+            if (!(Devices[j].child && Devices[j].child[0])) continue;
+            if (Devices[j].deadline || Devices[j].countdown) continue;
+            if (strcasecmp (Devices[j].id, Devices[i].id)) continue;
+            Devices[j].batched = 0;
+            Devices[j].queued = 0;
+            Devices[j].inflight = 1;
+            housekasa_device_arm (j);
+            list[count++] = j;
+        }
+        housekasa_device_control_children (list, count, state);
+    }
+}
+
+static void housekasa_device_reset (int i, int status) {
+
+    if ((Devices[i].status != status) || (Devices[i].commanded != status))
+        housestate_changed (LiveState);
+
+    Devices[i].commanded = Devices[i].status = status;
+    Devices[i].pending = Devices[i].deadline = 0;
+    Devices[i].priority = 0;
+    Devices[i].retry = 0;
+    Devices[i].batched = 0;
+    Devices[i].inflight = 0;
+    Devices[i].queued = 0;
+    Devices[i].fingerprint = 0;
+}
+
+// Handle the timed activities of one device: end of pulse, command retry
+// and command timeout.
+//
+static void housekasa_device_timer (int device) {
+
+    if (device < 0 || device >= DevicesCount) return; // Obsolete.
+
+    long long now = housekasa_timer_now();
+
+    housekasa_device_dim_timeout (device, now);
+
+    if (Devices[device].deadline > 0 && now >= Devices[device].deadline) {
+        houselog_event ("DEVICE", Devices[device].name, "RESET", "END OF PULSE");
+        Devices[device].commanded = 0;
+        Devices[device].deadline = 0;
+        Devices[device].priority = 0; // Done with any request.
+        housestate_changed (LiveState);
+        int countdown = Devices[device].countdown;
+        if (countdown == KASA_COUNTDOWN_SET)
+            Devices[device].countdown = KASA_COUNTDOWN_NONE;
+        if (Devices[device].status == Devices[device].commanded) {
+            Devices[device].pending = 0; // Already off.
+        } else if (countdown == KASA_COUNTDOWN_SET) {
+            // The device turned itself off: only verify that it did.
+            // The control is sent by the retry if the device is still on.
+            Devices[device].pending = now + KASA_PENDING;
+            housekasa_device_sense (&(Devices[device].ipaddress));
+            Devices[device].last_sense = now;
+            Devices[device].sent = 0; // Not a round trip sample.
+            Devices[device].retries = 0;
+            Devices[device].retry = now + KASA_COUNTDOWN_GRACE;
+            housekasa_device_schedule (device, Devices[device].retry);
+        } else {
+            Devices[device].pending = now + KASA_PENDING;
+            housekasa_device_transmit (device);
+        }
+    }
+
+    if (Devices[device].queued) return; // Waiting for its turn.
+    if ((!Devices[device].retry) || (Devices[device].retry > now)) return;
+
+    in_addr_t address = Devices[device].ipaddress.sin_addr.s_addr;
+    if (Devices[device].status == Devices[device].commanded) {
+        Devices[device].retry = 0;
+        Devices[device].pending = 0; // Reached, even if not confirmed.
+        if (Devices[device].inflight) housekasa_device_advance (address);
+        return;
+    }
+    if (now >= Devices[device].pending) {
+        if (Devices[device].pending) {
+            housekasa_metrics_increment (KASA_METRIC_TIMEOUT);
+            houselog_event ("DEVICE", Devices[device].name, "TIMEOUT", "");
+        }
+        int inflight = Devices[device].inflight;
+        housekasa_device_reset (device, Devices[device].status);
+        if (inflight) housekasa_device_advance (address);
+        return;
+    }
+
+    // Exponential backoff, starting from the device's timeout.
+    Devices[device].retries += 1;
+    long long backoff =
+        (long long)Devices[device].rto << Devices[device].retries;
+    if (backoff > KASA_RTO_MAX) backoff = KASA_RTO_MAX;
+    Devices[device].retry = now + backoff;
+    housekasa_device_schedule (device, Devices[device].retry);
+
+    if (Devices[device].detected) {
+        if ((!Devices[device].inflight) && housekasa_device_busy (device)) {
+            housekasa_device_queue (device); // Wait for the other command.
+            return;
+        }
+        Devices[device].inflight = 1;
+        housekasa_metrics_increment (KASA_METRIC_RETRY);
+        if (housekasa_device_event_allowed (device, KASA_EVENT_RETRY))
+            houselog_event ("DEVICE", Devices[device].name, "RETRY",
+                            Devices[device].commanded?"on":"off");
+        housekasa_device_control (device, Devices[device].commanded);
+    }
+}
+
+static int housekasa_device_poll_due (int device, long long clock) {
+
+    int interval = KASA_POLL_IDLE;
+    if ((Devices[device].pending > clock) ||
+        (clock < Devices[device].changed + KASA_ACTIVE))
+        interval = KASA_POLL_ACTIVE;
+
+    if (clock < Devices[device].last_sense + interval) return 0;
+    if (clock < Devices[device].detected + interval) return 0; // Heard.
+    return 1;
+}
+
+static void housekasa_device_snapshot_save (void) {
+
+    int i;
+    int size = sizeof(struct SnapshotHeader)
+                   + (DevicesCount * sizeof(struct SnapshotRecord));
+    char *buffer = calloc (1, size);
+    if (!buffer) return;
+
+    struct SnapshotHeader *header = (struct SnapshotHeader *)buffer;
+    struct SnapshotRecord *record = (struct SnapshotRecord *)(header + 1);
+
+    memcpy (header->magic, KASA_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->count = 0;
+    header->size = sizeof(struct SnapshotRecord);
+
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!Devices[i].id) continue;
+        if (!Devices[i].ipaddress.sin_addr.s_addr) continue; // Never seen.
+        snprintf (record->id, sizeof(record->id), "%s", Devices[i].id);
+        if (Devices[i].child)
+            snprintf (record->child, sizeof(record->child), "%s", Devices[i].child);
+        record->address = Devices[i].ipaddress.sin_addr.s_addr;
+        record->brightness = Devices[i].brightness;
+        record->status = Devices[i].status;
+        record += 1;
+        header->count += 1;
+    }
+    size = (char *)record - buffer;
+
+    // Do not wear out the storage when nothing changed.
+    if ((size == KasaSnapshotLatestSize) &&
+        (!memcmp (buffer, KasaSnapshotLatest, size))) {
+        free (buffer);
+        return;
+    }
+
+    char temp[1024];
+    snprintf (temp, sizeof(temp), "%s.new", KasaSnapshotPath);
+    int fd = open (temp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        if (KasaSnapshotLatestSize >= 0)
+            houselog_trace (HOUSE_WARNING, KasaSnapshotPath,
+                            "cannot write: %s", strerror(errno));
+        KasaSnapshotLatestSize = -1; // Do not repeat the trace.
+        free (buffer);
+        return;
+    }
+    int written = write (fd, buffer, size);
+    close (fd);
+    if ((written != size) || (rename (temp, KasaSnapshotPath) < 0)) {
+        unlink (temp);
+        free (buffer);
+        return;
+    }
+    free (KasaSnapshotLatest);
+    KasaSnapshotLatest = buffer;
+    KasaSnapshotLatestSize = size;
+}
+
+static void housekasa_device_snapshot_load (void) {
+
+    struct stat info;
+    int i;
+
+    int fd = open (KasaSnapshotPath, O_RDONLY);
+    if (fd < 0) return; // No snapshot yet.
+
+    if ((fstat (fd, &info) < 0) || (info.st_size < sizeof(struct SnapshotHeader))) {
+        close (fd);
+        return;
+    }
+    const char *map = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) return;
+
+    const struct SnapshotHeader *header = (const struct SnapshotHeader *)map;
+    const struct SnapshotRecord *record =
+        (const struct SnapshotRecord *)(header + 1);
+
+    if (memcmp (header->magic, KASA_SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+        (header->size != sizeof(struct SnapshotRecord)) ||
+        (header->count < 0) ||
+        (info.st_size < sizeof(struct SnapshotHeader)
+                            + (header->count * sizeof(struct SnapshotRecord)))) {
+        houselog_trace (HOUSE_WARNING, KasaSnapshotPath, "invalid snapshot");
+        munmap ((void *)map, info.st_size);
+        return;
+    }
+
+    long long now = housekasa_timer_now();
+    int loaded = 0;
+
+    for (i = 0; i < header->count; ++i, ++record) {
+        char id[sizeof(record->id)+1];
+        char child[sizeof(record->child)+1];
+        strtcpy (id, record->id, sizeof(id));
+        strtcpy (child, record->child, sizeof(child));
+
+        int device = housekasa_device_id_search (id, child[0] ? child : 0);
+        if (device < 0) continue; // Removed from the configuration.
+        if (Devices[device].detected) continue; // Already heard from.
+        if (!housekasa_shard_owned (id)) continue; // Another instance's.
+
+        Devices[device].ipaddress.sin_family = AF_INET;
+        Devices[device].ipaddress.sin_port = htons(KasaDevicePort);
+        Devices[device].ipaddress.sin_addr.s_addr = record->address;
+        Devices[device].status = Devices[device].commanded = record->status;
+        Devices[device].brightness = record->brightness;
+        Devices[device].stale = 1;
+        loaded += 1;
+
+        // Query the device right away: do not wait for the polling.
+        if (Devices[device].last_sense < now) {
+            int j;
+            housekasa_device_sense (&(Devices[device].ipaddress));
+            for (j = 0; j < DevicesCount; ++j) {
+                if (Devices[j].ipaddress.sin_addr.s_addr == record->address)
+                    Devices[j].last_sense = now;
+            }
+        }
+    }
+    munmap ((void *)map, info.st_size);
+
+    KasaSnapshotLoaded = now;
+    if (loaded) housestate_changed (LiveState);
+    houselog_event ("SNAPSHOT", KasaSnapshotPath, "LOADED",
+                    "%d DEVICES", loaded);
+}
+
+// Sweep the next addresses of a local subnet. Return 0 when done.
+//
+static int housekasa_device_sweep (const struct NetworkMap *network) {
+
+    in_addr_t mask = ntohl(network->netmask.s_addr);
+    in_addr_t base = ntohl(network->local.s_addr) & mask;
+    unsigned int size = (~mask) + 1;
+    int sent = 0;
+
+    struct sockaddr_in addr = network->addr;
+    while ((KasaSweepNext < size) && (sent < KASA_SWEEP_RATE)) {
+        unsigned int host = KasaSweepNext++;
+        if ((host == 0) || (host == size - 1)) continue; // Network, broadcast.
+        addr.sin_addr.s_addr = htonl(base + host);
+        if (addr.sin_addr.s_addr == network->local.s_addr) continue;
+        housekasa_device_sense (&addr);
+        sent += 1;
+    }
+    return (KasaSweepNext < size);
+}
+
+// Some host name lookups completed: apply the new addresses, and query
+// the new networks or devices right away. This also tells the resolver
+// which names are still in use.
+//
+static void housekasa_device_resolved (void) {
+
+    int i;
+    struct in_addr addr;
+
+    for (i = 1; i < KasaSenseCount; ++i) {
+        if (!(KasaSense[i].name && KasaSense[i].name[0])) continue;
+        if (!housekasa_resolve (KasaSense[i].name, &addr)) continue;
+        if (addr.s_addr == KasaSense[i].addr.sin_addr.s_addr) continue;
+        KasaSense[i].addr.sin_addr = addr;
+        houselog_event ("NETWORK", KasaSense[i].name, "ADDED", "AS %s",
+                        inet_ntoa(addr));
+        housekasa_device_sense (&(KasaSense[i].addr));
+    }
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!(Devices[i].host && Devices[i].host[0])) continue;
+        if (Devices[i].detected) continue; // The device told us already.
+        if (!housekasa_resolve (Devices[i].host, &addr)) continue;
+        if (addr.s_addr == Devices[i].ipaddress.sin_addr.s_addr) continue;
+        Devices[i].ipaddress.sin_family = AF_INET;
+        Devices[i].ipaddress.sin_port = htons(KasaDevicePort);
+        Devices[i].ipaddress.sin_addr = addr;
+        housekasa_device_sense (&(Devices[i].ipaddress));
+        Devices[i].last_sense = housekasa_timer_now();
+    }
+}
+
+// Run the next step of the current discovery round.
+//
+static void housekasa_device_discover (void) {
 
-    if (echttp_isdebug()) {
-        if (pulse) fprintf (stderr, "set %s to %s at %lld (pulse %ds)%s\n", Devices[device].name, namedstate, (long long)now, pulse, comment);
-        else       fprintf (stderr, "set %s to %s at %lld%s\n", Devices[device].name, namedstate, (long long)now, comment);
-    }
+    int i;
 
-    if (pulse > 0) {
-        // A new pulse can only extend a reset deadline, not shorten it.
-        time_t deadline = now + pulse;
-        if (deadline > Devices[device].deadline) {
-            Devices[device].deadline = deadline;
-            houselog_event ("DEVICE", Devices[device].name, "SET",
-                            "%s FOR %d SECONDS%s", namedstate, pulse, comment);
+    if (KasaDiscoveryMode == KASA_DISCOVERY_BROADCAST) {
+        for (i = 0; i < KasaSenseCount; ++i) {
+            if (!KasaSense[i].addr.sin_addr.s_addr) continue; // Unresolved.
+            housekasa_device_sense(&(KasaSense[i].addr));
         }
-    } else {
-        Devices[device].deadline = 0;
-        houselog_event ("DEVICE", Devices[device].name, "SET",
-                        "%s%s", namedstate, comment);
+        KasaDiscoveryNext = -1;
+        return;
     }
-    Devices[device].commanded = state;
-    Devices[device].pending = now + 5;
 
-    // Only send a command if we detected the device on the network.
+    // The limited broadcast reaches the same devices as the directed
+    // broadcast of the main interface: skip it if there is another.
     //
-    if (Devices[device].detected) {
-        housekasa_device_control (device, state);
+    if ((KasaDiscoveryNext == 0) && (KasaSenseCount > 1)) KasaDiscoveryNext = 1;
+    if (KasaDiscoveryNext >= KasaSenseCount) {
+        KasaDiscoveryNext = -1;
+        return;
     }
-}
 
-static void housekasa_device_reset (int i, int status) {
+    const struct NetworkMap *network = KasaSense + KasaDiscoveryNext;
+    if ((KasaDiscoveryMode == KASA_DISCOVERY_UNICAST) &&
+        network->ifindex && network->netmask.s_addr &&
+        ((~ntohl(network->netmask.s_addr)) < KASA_SWEEP_MAX)) {
+        if (housekasa_device_sweep (network)) return; // Not done yet.
+    } else if (network->addr.sin_addr.s_addr) {
+        housekasa_device_sense (&(network->addr));
+    }
+    KasaDiscoveryNext += 1;
+    KasaSweepNext = 0;
+}
 
-    if (Devices[i].status != status) housestate_changed (LiveState);
+// Escalate the discovery mode when the kernel dropped replies, relax it
+// after a calm period. A new mode is given one full round to show
+// its effect before escalating again.
+//
+static void housekasa_device_discovery_adapt (long long clock) {
+
+    int dropped = housekasa_io_overflows ();
+    int mode = KasaDiscoveryMode;
+
+    if (dropped > 0) {
+        KasaDiscoveryDropped = clock;
+        if ((mode < KASA_DISCOVERY_UNICAST) &&
+            (clock >= KasaDiscoveryChanged + KASA_DISCOVERY_PERIOD))
+            mode += 1;
+    } else if ((mode > KASA_DISCOVERY_BROADCAST) &&
+               (clock >= KasaDiscoveryDropped + KASA_DISCOVERY_CALM) &&
+               (clock >= KasaDiscoveryChanged + KASA_DISCOVERY_CALM)) {
+        mode -= 1;
+    }
+    if (mode == KasaDiscoveryMode) return;
 
-    Devices[i].commanded = Devices[i].status = status;
-    Devices[i].pending = Devices[i].deadline = 0;
-    Devices[i].priority = 0;
+    if (dropped > 0)
+        houselog_event ("NETWORK", "discovery", KasaDiscoveryNames[mode],
+                        "AFTER %d REPLIES DROPPED", dropped);
+    else
+        houselog_event ("NETWORK", "discovery", KasaDiscoveryNames[mode],
+                        "NO REPLY DROPPED FOR %d MINUTES",
+                        KASA_DISCOVERY_CALM / 60000);
+    KasaDiscoveryMode = mode;
+    KasaDiscoveryChanged = clock;
 }
 
 void housekasa_device_periodic (time_t now) {
 
-    static time_t LastRetry = 0;
-    static time_t LastSense = 0;
-    int i;
+    static long long LastCheck = 0;
+    static long long LastSense = 0;
+    static long long LastSnapshot = 0;
+    int i, j, n;
 
-    if (now >= LastSense + 60) {
-        for (i = 0; i < KasaSenseCount; ++i)
-            housekasa_device_sense(&(KasaSense[i].addr));
-        LastSense = now;
+    // All the device timing uses the monotonic clock, not the wall clock.
+    long long clock = housekasa_timer_now();
+
+    // A discovery round spread over time is never restarted midway:
+    // the next round starts once it has completed.
+    //
+    if ((clock >= LastSense + KASA_DISCOVERY_PERIOD) &&
+        (KasaDiscoveryNext < 0)) {
+        KasaDiscoveryNext = 0;
+        KasaSweepNext = 0;
+        LastSense = clock;
+        if (KasaDiscoveryMode == KASA_DISCOVERY_BROADCAST)
+            housekasa_device_discover ();
     }
 
-    if (now < LastRetry + 5) return;
-    LastRetry = now;
+    if (clock < LastCheck + 1000) return;
+    LastCheck = clock;
 
-    for (i = 0; i < DevicesCount; ++i) {
+    housekasa_device_discovery_adapt (clock);
+    if (housekasa_resolve_background ()) housekasa_device_resolved ();
+    if (KasaDiscoveryNext >= 0) housekasa_device_discover ();
 
-        if (now >= Devices[i].last_sense + 35) {
-            if (Devices[i].ipaddress.sin_addr.s_addr != 0)
-                housekasa_device_sense(&(Devices[i].ipaddress));
-            Devices[i].last_sense = now;
-        }
+    if (KasaSnapshotPath[0] && (clock >= LastSnapshot + KASA_SNAPSHOT_PERIOD)) {
+        if (LastSnapshot) housekasa_device_snapshot_save ();
+        LastSnapshot = clock;
+    }
 
-        // If we did not detect a device for 3 senses, consider it failed.
-        if (Devices[i].detected > 0 && Devices[i].detected < now - 100) {
-            houselog_event ("DEVICE", Devices[i].name, "SILENT",
-                            "ADDRESS %s",
-                            inet_ntoa(Devices[i].ipaddress.sin_addr));
-            housekasa_device_reset (i, 0);
-            Devices[i].detected = 0;
-        }
+    KasaPollTokens += (int)((clock - KasaPollRefill) * KasaPollRate / 1000);
+    if (KasaPollTokens > KasaPollRate) KasaPollTokens = KasaPollRate;
+    KasaPollRefill = clock;
+
+    // Start where the previous scan stopped, so that the budget is
+    // shared fairly when it is not enough for all devices.
+    //
+    if (KasaPollCursor >= DevicesCount) KasaPollCursor = 0;
+    int start = KasaPollCursor;
 
-        if (Devices[i].deadline > 0 && now >= Devices[i].deadline) {
-            houselog_event ("DEVICE", Devices[i].name, "RESET", "END OF PULSE");
-            Devices[i].commanded = 0;
-            Devices[i].pending = now + 5;
-            Devices[i].deadline = 0;
-            Devices[i].priority = 0; // Done with any request.
+    for (n = 0; n < DevicesCount; ++n) {
+
+        i = (start + n) % DevicesCount;
+
+        if (!housekasa_shard_owned (Devices[i].id)) {
+            Devices[i].detected = 0; // Ready if it comes back to us.
+            Devices[i].stale = 0;
+            continue;
         }
-        if (Devices[i].status != Devices[i].commanded) {
-            if (Devices[i].pending > now) {
-                if (Devices[i].detected) {
-                    const char *state = Devices[i].commanded?"on":"off";
-                    houselog_event ("DEVICE", Devices[i].name, "RETRY", state);
-                    housekasa_device_control (i, Devices[i].commanded);
-                }
+
+        if (housekasa_device_poll_due (i, clock)) {
+            if (KasaPollTokens <= 0) {
+                housekasa_metrics_increment (KASA_METRIC_DEFERRED);
             } else {
-                if (Devices[i].pending)
-                    houselog_event ("DEVICE", Devices[i].name, "TIMEOUT", "");
-                housekasa_device_reset (i, Devices[i].status);
+                in_addr_t address = Devices[i].ipaddress.sin_addr.s_addr;
+                if (address != 0) {
+                    housekasa_device_sense(&(Devices[i].ipaddress));
+                    KasaPollTokens -= 1;
+                    // One poll covers all outlets of a multi-outlet device.
+                    for (j = 0; j < DevicesCount; ++j) {
+                        if (Devices[j].ipaddress.sin_addr.s_addr == address)
+                            Devices[j].last_sense = clock;
+                    }
+                }
+                Devices[i].last_sense = clock;
+                KasaPollCursor = i + 1;
             }
         }
+
+        // A queued command must not wait forever if the acknowledgement
+        // of the previous one was lost.
+        if (Devices[i].queued && !housekasa_device_busy (i))
+            housekasa_device_dispatch (i);
+
+        housekasa_device_event_summary (i, clock);
+
+        // A state loaded from the snapshot is only shown for a while.
+        if (Devices[i].stale &&
+            (clock >= KasaSnapshotLoaded + KASA_SNAPSHOT_STALE)) {
+            Devices[i].stale = 0;
+            housestate_changed (LiveState);
+        }
+
+        // If we did not detect a device for 3 senses, consider it failed.
+        if (Devices[i].detected > 0 && Devices[i].detected < clock - 100000) {
+            housekasa_metrics_increment (KASA_METRIC_SILENT);
+            if (housekasa_device_event_allowed (i, KASA_EVENT_SILENT))
+                houselog_event ("DEVICE", Devices[i].name, "SILENT",
+                                "ADDRESS %s",
+                                inet_ntoa(Devices[i].ipaddress.sin_addr));
+            int inflight = Devices[i].inflight;
+            housekasa_device_reset (i, 0);
+            Devices[i].detected = 0;
+            housestate_changed (LiveState); // Now reported as silent.
+            // Release the commands queued behind the abandoned one.
+            if (inflight)
+                housekasa_device_advance (Devices[i].ipaddress.sin_addr.s_addr);
+        }
     }
 }
 
@@ -422,37 +1507,228 @@ static int housekasa_device_add (const char *model,
                                  const char *id, const char *child) {
     if (DevicesCount < DevicesSpace) {
         int i = DevicesCount++;
+
+        // The devices are reloaded in the same slots on a configuration
+        // refresh: the address, the device details and the dimmer state
+        // are kept if this slot was already used by the same device, and
+        // forgotten otherwise.
+        //
+        int same = Devices[i].id && (!strcmp (Devices[i].id, id)) &&
+                   (child ? (Devices[i].child &&
+                             (!strcmp (Devices[i].child, child)))
+                          : (!Devices[i].child));
+        if (!same) {
+            memset (&(Devices[i].ipaddress), 0, sizeof(Devices[i].ipaddress));
+            memset (&(Devices[i].info), 0, sizeof(Devices[i].info));
+            if (Devices[i].child) {
+                free (Devices[i].child);
+                Devices[i].child = 0;
+            }
+            Devices[i].ifindex = 0;
+            Devices[i].srtt = Devices[i].rttvar = Devices[i].rto = 0;
+            Devices[i].brightness = -1;
+            Devices[i].dim_sent = Devices[i].dim_wanted = -1;
+        }
         Devices[i].id = strdup (id);
         Devices[i].model = model?strdup (model):0;
+        housekasa_device_model_resolve (i);
         if (child)
             Devices[i].child = strdup(child);
         housekasa_device_reset (i, 0);
         Devices[i].last_sense = 0;
         return i;
     }
+    housekasa_metrics_increment (KASA_METRIC_NOSPACE);
     houselog_trace (HOUSE_FAILURE,
                     "DEVICE", "no space for device %s", id);
     return -1;
 }
 
-static int housekasa_device_gethost (const char *name, struct sockaddr_in *a) {
-    struct addrinfo hints;
-    struct addrinfo *resolved;
+static void housekasa_device_network_add (const struct NetworkMap *network) {
 
-    hints.ai_flags = 0;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = 0;
-    if (getaddrinfo (name, 0, &hints, &resolved)) return 0;
-    if (resolved) {
-        a->sin_addr.s_addr =
-            ((struct sockaddr_in *)(resolved->ai_addr))->sin_addr.s_addr;
-        freeaddrinfo (resolved);
-        return 1;
+    if (KasaSenseCount >= KasaSenseSpace) {
+        KasaSenseSpace += 16;
+        KasaSense = realloc (KasaSense, KasaSenseSpace * sizeof(*KasaSense));
+    }
+    KasaSense[KasaSenseCount++] = *network;
+}
+
+// Drop the configured networks. The local interfaces are kept, so that
+// housekasa_device_interfaces() only reports the ones that changed.
+//
+static void housekasa_device_network_reset (void) {
+
+    int i;
+    if (KasaSenseCount > 0) {
+        int kept = 1; // The limited broadcast is always first.
+        for (i = 1; i < KasaSenseCount; ++i) {
+            if (KasaSense[i].ifname)
+                KasaSense[kept++] = KasaSense[i];
+            else if (KasaSense[i].name)
+                free(KasaSense[i].name);
+        }
+        KasaSenseCount = kept;
+        return;
+    }
+
+    struct NetworkMap network;
+    memset (&network, 0, sizeof(network));
+    network.addr.sin_family = AF_INET;
+    network.addr.sin_port = htons(KasaDevicePort);
+    network.addr.sin_addr.s_addr = INADDR_BROADCAST;
+    housekasa_device_network_add (&network);
+}
+
+static int housekasa_device_network_search (const struct NetworkMap *list,
+                                            int count, const char *ifname,
+                                            const struct sockaddr_in *addr) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (ifname) {
+            if ((!list[i].ifname) || strcmp (ifname, list[i].ifname)) continue;
+        }
+        if (list[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr) return i;
+    }
+    return -1;
+}
+
+// Rebuild the list of directed broadcast addresses from the local
+// interfaces. If requested, sense each new network segment immediately.
+//
+static void housekasa_device_interfaces (int sense) {
+
+    struct ifaddrs *cards;
+    struct ifaddrs *cursor;
+    int i;
+
+    if (!KasaSenseCount) return; // Not yet initialized.
+
+    if (getifaddrs(&cards)) {
+        houselog_trace (HOUSE_FAILURE, "NETWORK",
+                        "getifaddrs() failed: %s", strerror(errno));
+        return;
+    }
+
+    // Detach the interfaces from the current list, keep them aside for
+    // detecting changes.
+    //
+    int oldcount = 0;
+    struct NetworkMap *old = calloc (KasaSenseCount, sizeof(*old));
+    int configured = 0;
+    for (i = 0; i < KasaSenseCount; ++i) {
+        if (KasaSense[i].ifname)
+            old[oldcount++] = KasaSense[i];
+        else
+            KasaSense[configured++] = KasaSense[i];
+    }
+    KasaSenseCount = configured;
+
+    for (cursor = cards; cursor; cursor = cursor->ifa_next) {
+
+        if (!cursor->ifa_addr) continue;
+        if (cursor->ifa_addr->sa_family != AF_INET) continue;
+        if (!(cursor->ifa_flags & IFF_UP)) continue;
+        if (cursor->ifa_flags & IFF_LOOPBACK) continue;
+        if (!(cursor->ifa_flags & IFF_BROADCAST)) continue;
+        if (!cursor->ifa_broadaddr) continue;
+
+        struct NetworkMap network;
+        memset (&network, 0, sizeof(network));
+        network.addr.sin_family = AF_INET;
+        network.addr.sin_port = htons(KasaDevicePort);
+        network.addr.sin_addr =
+            ((struct sockaddr_in *)(cursor->ifa_broadaddr))->sin_addr;
+        network.local = ((struct sockaddr_in *)(cursor->ifa_addr))->sin_addr;
+        if (cursor->ifa_netmask)
+            network.netmask =
+                ((struct sockaddr_in *)(cursor->ifa_netmask))->sin_addr;
+
+        // Do not duplicate a network that was explicitly configured.
+        if (housekasa_device_network_search
+                (KasaSense, KasaSenseCount, 0, &(network.addr)) >= 0) continue;
+
+        network.ifname = strdup (cursor->ifa_name);
+        network.ifindex = if_nametoindex (cursor->ifa_name);
+        housekasa_device_network_add (&network);
+
+        int known = housekasa_device_network_search
+                        (old, oldcount, network.ifname, &(network.addr));
+        if (known >= 0) {
+            free (old[known].ifname);
+            old[known].ifname = 0;
+        } else {
+            houselog_event ("NETWORK", network.ifname, "ADDED", "AS %s",
+                            inet_ntoa(network.addr.sin_addr));
+            if (sense) housekasa_device_sense (&(network.addr));
+        }
+    }
+    freeifaddrs (cards);
+
+    for (i = 0; i < oldcount; ++i) {
+        if (!old[i].ifname) continue;
+        houselog_event ("NETWORK", old[i].ifname, "REMOVED", "WAS %s",
+                        inet_ntoa(old[i].addr.sin_addr));
+        free (old[i].ifname);
+    }
+    free (old);
+}
+
+// Find the interface a device belongs to when the kernel did not tell.
+//
+static int housekasa_device_attribute (const struct sockaddr_in *addr) {
+    int i;
+    for (i = 0; i < KasaSenseCount; ++i) {
+        if (!KasaSense[i].ifindex) continue;
+        in_addr_t mask = KasaSense[i].netmask.s_addr;
+        if ((addr->sin_addr.s_addr & mask) == (KasaSense[i].local.s_addr & mask))
+            return KasaSense[i].ifindex;
     }
     return 0;
 }
 
+static const char *housekasa_device_ifname (int device) {
+    static char buffer[IF_NAMESIZE+8];
+    char ifname[IF_NAMESIZE];
+    if (!Devices[device].ifindex) return "";
+    if (!if_indextoname (Devices[device].ifindex, ifname)) return "";
+    snprintf (buffer, sizeof(buffer), " ON %s", ifname);
+    return buffer;
+}
+
+// The kernel notifies of any interface or address change through netlink.
+// The notification content is not used: just rebuild the list.
+//
+static void housekasa_device_interfaces_changed (int fd, int mode) {
+    char buffer[4096];
+    int changed = 0;
+    while (recv (KasaInterfaceWatch, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+        changed = 1;
+    if (changed) housekasa_device_interfaces (1);
+}
+
+static void housekasa_device_interfaces_watch (void) {
+
+    struct sockaddr_nl local;
+
+    KasaInterfaceWatch = socket (AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (KasaInterfaceWatch < 0) {
+        houselog_trace (HOUSE_WARNING, "NETWORK",
+                        "cannot open netlink socket: %s", strerror(errno));
+        return;
+    }
+    memset (&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind (KasaInterfaceWatch, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        houselog_trace (HOUSE_WARNING, "NETWORK",
+                        "cannot bind netlink socket: %s", strerror(errno));
+        close (KasaInterfaceWatch);
+        KasaInterfaceWatch = -1;
+        return;
+    }
+    echttp_listen (KasaInterfaceWatch, 1, housekasa_device_interfaces_changed, 0);
+}
+
 const char *housekasa_device_refresh (void) {
 
     int i;
@@ -464,6 +1740,8 @@ const char *housekasa_device_refresh (void) {
         Devices[i].deadline = 0;
         Devices[i].priority = 0;
         Devices[i].pending = 0;
+        Devices[i].retry = 0;
+        Devices[i].stale = 0;
     }
     DevicesCount = 0;
 
@@ -506,44 +1784,52 @@ const char *housekasa_device_refresh (void) {
                                          houseconfig_string (device, ".child"));
         housekasa_device_refresh_string (&(Devices[idx].description),
                                          houseconfig_string (device, ".description"));
+        housekasa_device_refresh_string (&(Devices[idx].host),
+                                         houseconfig_string (device, ".ip"));
+        if (Devices[idx].host && Devices[idx].host[0] &&
+            (!Devices[idx].ipaddress.sin_addr.s_addr)) {
+            // Last known address: the device can be queried right away.
+            // A host name is resolved in the background.
+            if (housekasa_resolve (Devices[idx].host,
+                                   &(Devices[idx].ipaddress.sin_addr))) {
+                Devices[idx].ipaddress.sin_family = AF_INET;
+                Devices[idx].ipaddress.sin_port = htons(KasaDevicePort);
+            }
+        }
         if (echttp_isdebug()) fprintf (stderr, "load device %s, ID %s%s\n", Devices[idx].name, Devices[idx].id, Devices[i].child);
         housekasa_device_reset (idx, Devices[idx].status);
     }
     free (list);
 
-    devices = houseconfig_array (0, ".kasa.net");
-    if (devices < 0) return 0; // Let's make this array optional.
+    housekasa_device_network_reset ();
 
-    requested = houseconfig_array_length (devices);
-    if (echttp_isdebug()) fprintf (stderr, "found %d networks\n", requested);
-    if (requested >= KASASENSEMAX) requested = KASASENSEMAX - 1;
+    devices = houseconfig_array (0, ".kasa.net");
+    if (devices >= 0) { // Let's make this array optional.
 
-    for (i = 0; i < KasaSenseCount; ++i) {
-        if (KasaSense[i].name) free(KasaSense[i].name);
-        KasaSense[i].name = 0;
-    }
-    KasaSenseCount = 1;
+        requested = houseconfig_array_length (devices);
+        if (echttp_isdebug()) fprintf (stderr, "found %d networks\n", requested);
 
-    list = calloc (requested, sizeof(int));
-    requested = houseconfig_enumerate (devices, list, requested);
-    for (i = 0; i < requested; ++i) {
-        KasaSense[KasaSenseCount] = KasaSense[0];
-        const char *addr = houseconfig_string(list[i], "");
-        if ((!addr) || (addr[0] == 0)) continue;
-        if (echttp_isdebug())
-            fprintf (stderr, "load broadcast IP address %s\n", addr);
-        if (!housekasa_device_gethost(addr,&(KasaSense[KasaSenseCount].addr))) {
+        list = calloc (requested, sizeof(int));
+        requested = houseconfig_enumerate (devices, list, requested);
+        for (i = 0; i < requested; ++i) {
+            struct NetworkMap network = KasaSense[0];
+            const char *addr = houseconfig_string(list[i], "");
+            if ((!addr) || (addr[0] == 0)) continue;
             if (echttp_isdebug())
-                fprintf (stderr, "invalid address %s\n", addr);
-        } else {
-            houselog_event ("NETWORK", addr, "ADDED", "AS %s",
-                            inet_ntoa(KasaSense[KasaSenseCount].addr.sin_addr));
-            KasaSense[KasaSenseCount].name = strdup(addr);
-            KasaSenseCount += 1;
-            if (KasaSenseCount >= KASASENSEMAX) break;
+                fprintf (stderr, "load broadcast IP address %s\n", addr);
+            // A host name is resolved in the background: the network is
+            // ignored until its address is known.
+            network.addr.sin_addr.s_addr = 0;
+            if (housekasa_resolve (addr, &(network.addr.sin_addr)))
+                houselog_event ("NETWORK", addr, "ADDED", "AS %s",
+                                inet_ntoa(network.addr.sin_addr));
+            network.name = strdup(addr);
+            housekasa_device_network_add (&network);
         }
+        free (list);
     }
-    free (list);
+
+    housekasa_device_interfaces (0);
 
     return 0;
 }
@@ -564,9 +1850,12 @@ const char *housekasa_device_live_config (char *buffer, int size) {
         int device = echttp_json_add_object (context, items, 0);
         if (Devices[i].name && Devices[i].name[0])
             echttp_json_add_string (context, device, "name", Devices[i].name);
-        if (Devices[i].ipaddress.sin_addr.s_addr)
+        // Keep the configured host name, which the address came from.
+        if (Devices[i].host && Devices[i].host[0])
+            echttp_json_add_string (context, device, "ip", Devices[i].host);
+        else if (Devices[i].ipaddress.sin_addr.s_addr)
             echttp_json_add_string
-                (context, device, "ip", 
+                (context, device, "ip",
                  inet_ntoa(Devices[i].ipaddress.sin_addr));
         if (Devices[i].model && Devices[i].model[0])
             echttp_json_add_string (context, device, "model", Devices[i].model);
@@ -578,7 +1867,10 @@ const char *housekasa_device_live_config (char *buffer, int size) {
             echttp_json_add_string (context, device, "description", Devices[i].description);
     }
 
-    if (KasaSenseCount > 1) {
+    for (i = 1; i < KasaSenseCount; ++i) {
+        if (KasaSense[i].name && KasaSense[i].name[0]) break;
+    }
+    if (i < KasaSenseCount) {
         items = echttp_json_add_array (context, top, "net");
         for (i = 1; i < KasaSenseCount; ++i) {
             if (KasaSense[i].name && KasaSense[i].name[0])
@@ -588,12 +1880,90 @@ const char *housekasa_device_live_config (char *buffer, int size) {
     return echttp_json_export (context, buffer, size);
 }
 
+static void housekasa_device_inventory_add (ParserContext context,
+                                            int device, int i,
+                                            long long now) {
+
+    const struct DeviceInfo *info = &(Devices[i].info);
+    const char *status = housekasa_device_failure(i);
+    if (!status) status = Devices[i].status?"on":"off";
+
+    echttp_json_add_string (context, device, "name", Devices[i].name);
+    echttp_json_add_string (context, device, "state", status);
+    if (Devices[i].model && Devices[i].model[0])
+        echttp_json_add_string (context, device, "model", Devices[i].model);
+    if (Devices[i].id && Devices[i].id[0])
+        echttp_json_add_string (context, device, "id", Devices[i].id);
+    if (Devices[i].child && Devices[i].child[0])
+        echttp_json_add_string (context, device, "child", Devices[i].child);
+    if (Devices[i].ipaddress.sin_addr.s_addr)
+        echttp_json_add_string (context, device, "address",
+                                inet_ntoa(Devices[i].ipaddress.sin_addr));
+    if (Devices[i].detected)
+        echttp_json_add_integer (context, device, "seen",
+                                 (long)((now - Devices[i].detected) / 1000));
+    if (info->rssi)
+        echttp_json_add_integer (context, device, "rssi", info->rssi);
+    if (!info->updated) return; // No details yet.
+
+    echttp_json_add_integer (context, device, "updated",
+                             (long)((now - info->updated) / 1000));
+    if (info->sw_ver[0])
+        echttp_json_add_string (context, device, "sw_ver", info->sw_ver);
+    if (info->hw_ver[0])
+        echttp_json_add_string (context, device, "hw_ver", info->hw_ver);
+    if (info->mac[0])
+        echttp_json_add_string (context, device, "mac", info->mac);
+    if (info->led_off >= 0)
+        echttp_json_add_bool (context, device, "led_off", info->led_off);
+    if (Devices[i].status) {
+        // The on time progressed since the reply was decoded.
+        echttp_json_add_integer (context, device, "on_time",
+            (long)(info->on_time + ((now - info->updated) / 1000)));
+    }
+}
+
+const char *housekasa_device_inventory (int point, char *buffer, int size) {
+
+    static char pool[65537];
+    static ParserToken token[4096];
+    ParserContext context = echttp_json_start (token, 4096, pool, sizeof(pool));
+
+    char host[256];
+    int i;
+    long long now = housekasa_timer_now();
+
+    gethostname (host, sizeof(host));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", host);
+    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
+
+    if (point >= 0) {
+        if (point >= DevicesCount) return "invalid point";
+        int item = echttp_json_add_object (context, root, "device");
+        housekasa_device_inventory_add (context, item, point, now);
+    } else {
+        int items = echttp_json_add_array (context, root, "devices");
+        for (i = 0; i < DevicesCount; ++i) {
+            if (!housekasa_shard_owned (Devices[i].id)) continue;
+            int item = echttp_json_add_object (context, items, 0);
+            housekasa_device_inventory_add (context, item, i, now);
+        }
+    }
+    return echttp_json_export (context, buffer, size);
+}
+
 static void housekasa_device_status_update (int device, int status) {
     if (device < 0) return;
-    if (!Devices[device].detected)
-        houselog_event ("DEVICE", Devices[device].name,
-            "DETECTED", "ADDRESS %s",
-            inet_ntoa(Devices[device].ipaddress.sin_addr));
+    if (!Devices[device].detected) {
+        if (housekasa_device_event_allowed (device, KASA_EVENT_DETECTED))
+            houselog_event ("DEVICE", Devices[device].name,
+                "DETECTED", "ADDRESS %s%s",
+                inet_ntoa(Devices[device].ipaddress.sin_addr),
+                housekasa_device_ifname(device));
+        housestate_changed (LiveState); // No longer reported as silent.
+    }
     if (status != Devices[device].status) {
         if (Devices[device].pending &&
                 (status == Devices[device].commanded)) {
@@ -601,24 +1971,53 @@ static void housekasa_device_status_update (int device, int status) {
                             "CONFIRMED", "FROM %s TO %s",
                             Devices[device].status?"on":"off",
                             status?"on":"off");
+            housekasa_device_rtt_update (device);
             Devices[device].pending = 0;
-        } else {
+            Devices[device].retry = 0;
+            if (Devices[device].inflight)
+                housekasa_device_advance
+                    (Devices[device].ipaddress.sin_addr.s_addr);
+        } else if ((!status) && Devices[device].deadline &&
+                   (Devices[device].countdown == KASA_COUNTDOWN_SET) &&
+                   (Devices[device].deadline - housekasa_timer_now()
+                        <= KASA_COUNTDOWN_GRACE)) {
+            // The count_down rule ended the pulse. Its delay was rounded
+            // down, so this may happen up to a second before the deadline.
             houselog_event ("DEVICE", Devices[device].name,
-                            "CHANGED", "FROM %s TO %s",
-                            Devices[device].status?"on":"off",
-                            status?"on":"off");
+                            "RESET", "END OF PULSE");
+            Devices[device].commanded = 0;
+            Devices[device].deadline = 0;
+            Devices[device].pending = 0;
+            Devices[device].retry = 0;
+            Devices[device].priority = 0; // Done with any request.
+            Devices[device].countdown = KASA_COUNTDOWN_NONE;
+        } else if (Devices[device].queued) {
+            // This is the outcome of an earlier command, which the queued
+            // one superseded: keep the queued command.
+        } else {
+            if (housekasa_device_event_allowed (device, KASA_EVENT_CHANGED))
+                houselog_event ("DEVICE", Devices[device].name,
+                                "CHANGED", "FROM %s TO %s",
+                                Devices[device].status?"on":"off",
+                                status?"on":"off");
             // Device commanded by someone else.
             Devices[device].commanded = status;
             Devices[device].pending = 0;
+            Devices[device].retry = 0;
             if (status)
                 Devices[device].priority = 1; // Overcome by (external) event.
             else
                 Devices[device].priority = 0; // Low priority when off.
         }
         Devices[device].status = status;
+        Devices[device].changed = housekasa_timer_now();
         housestate_changed (LiveState);
     }
-    Devices[device].detected = time(0);
+    if (Devices[device].stale) {
+        Devices[device].stale = 0;
+        housestate_changed (LiveState);
+    }
+    Devices[device].detected = housekasa_timer_now();
 }
 
 static const char *housekasa_device_json_string (ParserToken *json,
@@ -658,12 +2057,52 @@ int housekasa_device_json_array_object (ParserToken *json,
     return parent+i;
 }
 
+static void housekasa_device_info_string (char *store, int size,
+                                          const char *value) {
+    if (value) snprintf (store, size, "%s", value);
+}
+
+// Keep the details from a status reply. The on_time is specific to each
+// outlet: it is taken from the outlet's entry if there is one.
+//
+static void housekasa_device_info_update (int device, ParserToken *json,
+                                          int outlet) {
+    if (device < 0) return;
+
+    struct DeviceInfo *info = &(Devices[device].info);
+    const char *path = ".system.get_sysinfo.on_time";
+
+    housekasa_device_info_string (info->sw_ver, sizeof(info->sw_ver),
+        housekasa_device_json_string (json, 0, ".system.get_sysinfo.sw_ver"));
+    housekasa_device_info_string (info->hw_ver, sizeof(info->hw_ver),
+        housekasa_device_json_string (json, 0, ".system.get_sysinfo.hw_ver"));
+    housekasa_device_info_string (info->mac, sizeof(info->mac),
+        housekasa_device_json_string (json, 0, ".system.get_sysinfo.mac"));
+
+    int i = echttp_json_search (json, ".system.get_sysinfo.rssi");
+    if (i >= 0 && json[i].type == PARSER_INTEGER)
+        info->rssi = json[i].value.integer;
+    i = echttp_json_search (json, ".system.get_sysinfo.led_off");
+    info->led_off = (i >= 0 && json[i].type == PARSER_INTEGER) ?
+                        json[i].value.integer : -1;
+
+    if (outlet >= 0) {
+        json += outlet;
+        path = ".on_time";
+    }
+    i = echttp_json_search (json, path);
+    if (i >= 0 && json[i].type == PARSER_INTEGER)
+        info->on_time = json[i].value.integer;
+
+    info->updated = housekasa_timer_now();
+}
+
 static void housekasa_device_getinfo (ParserToken *json, int count,
-                                      struct sockaddr_in *addr,
+                                      struct sockaddr_in *addr, int ifindex,
                                       const char *data) {
 
     int device;
-    time_t now = time(0);
+    long long now = housekasa_timer_now();
 
     // Retrieve ID and current device state from the JSON data.
     //
@@ -674,6 +2113,8 @@ static void housekasa_device_getinfo (ParserToken *json, int count,
                         "DEVICE", "no valid device ID in: %s", data);
         return;
     }
+    if (!housekasa_shard_owned (id)) return; // Another instance's device.
+
     const char *model =
         housekasa_device_json_string (json, 0, ".system.get_sysinfo.model");
     if (!model) model = "(unknown)";
@@ -699,9 +2140,11 @@ static void housekasa_device_getinfo (ParserToken *json, int count,
                 housekasa_device_refresh_string
                     (&(Devices[device].name),
                      housekasa_device_json_string (json, child, ".alias"));
+                Devices[device].ifindex = ifindex;
                 houselog_event ("DEVICE", Devices[device].name, "DISCOVERED",
-                                "ADDRESS %s (CHILD %s)",
-                                inet_ntoa(addr->sin_addr), id);
+                                "ADDRESS %s%s (CHILD %s)",
+                                inet_ntoa(addr->sin_addr),
+                                housekasa_device_ifname(device), id);
                 DeviceListChanged = 1;
                 if (echttp_isdebug())
                      fprintf (stderr, "Device %s %s added\n", parent, id);
@@ -711,11 +2154,15 @@ static void housekasa_device_getinfo (ParserToken *json, int count,
                 if (echttp_isdebug())
                     fprintf (stderr, "Child plug %s (device %s)\n", id, Devices[device].name);
                 Devices[device].ipaddress = *addr; // Keep latest address.
-                if (!Devices[device].model)
+                Devices[device].ifindex = ifindex;
+                if (!Devices[device].model) {
                     Devices[device].model = strdup(model);
+                    housekasa_device_model_resolve (device);
+                }
             }
             housekasa_device_status_update
                 (device, housekasa_device_json_integer (json, child, ".state"));
+            housekasa_device_info_update (device, json, child);
         }
     } else {
         device = housekasa_device_id_search (id, 0);
@@ -725,105 +2172,317 @@ static void housekasa_device_getinfo (ParserToken *json, int count,
                 housekasa_device_refresh_string
                     (&(Devices[device].name),
                      housekasa_device_json_string(json, 0, ".system.get_sysinfo.alias"));
+                Devices[device].ifindex = ifindex;
                 houselog_event ("DEVICE", Devices[device].name, "DISCOVERED",
-                                "ADDRESS %s",
-                                inet_ntoa(addr->sin_addr));
+                                "ADDRESS %s%s",
+                                inet_ntoa(addr->sin_addr),
+                                housekasa_device_ifname(device));
                 DeviceListChanged = 1;
                 if (echttp_isdebug())
                      fprintf (stderr, "Device %s added\n", id);
             }
         }
-        if (device > 0) {
+        if (device >= 0) {
             Devices[device].ipaddress = *addr; // Keep latest address.
-            if (!Devices[device].model)
+            Devices[device].ifindex = ifindex;
+            if (!Devices[device].model) {
                 Devices[device].model = strdup(model);
+                housekasa_device_model_resolve (device);
+            }
+
+            int brightness =
+                echttp_json_search (json, ".system.get_sysinfo.brightness");
+            if (brightness >= 0 && json[brightness].type == PARSER_INTEGER) {
+                if (Devices[device].brightness != json[brightness].value.integer) {
+                    Devices[device].brightness = json[brightness].value.integer;
+                    housestate_changed (LiveState);
+                }
+            }
         }
         housekasa_device_status_update
             (device,
              housekasa_device_json_integer
                  (json, 0, ".system.get_sysinfo.relay_state"));
+        housekasa_device_info_update (device, json, -1);
+    }
+}
+
+// The count_down response does not identify the outlet: since only one
+// command is in flight for a device, it is about the one in flight. This
+// must be called before the status part of the response is processed,
+// since a confirmed state releases the command in flight. If no command
+// is in flight, the latest rule sent to that address is assumed.
+//
+static void housekasa_device_countdown_response
+                (const ParserToken *json, const struct sockaddr_in *addr) {
+    int i;
+    int device = -1;
+    int result = echttp_json_search (json, ".count_down.add_rule.err_code");
+    if (result < 0) result = echttp_json_search (json, ".count_down.err_code");
+    if (result < 0) return;
+
+    for (i = 0; i < DevicesCount; ++i) {
+        if (addr->sin_addr.s_addr != Devices[i].ipaddress.sin_addr.s_addr)
+            continue;
+        if (Devices[i].countdown != KASA_COUNTDOWN_SENT) continue;
+        if (Devices[i].inflight) {
+            device = i;
+            break;
+        }
+        if ((device < 0) || (Devices[i].sent > Devices[device].sent))
+            device = i;
+    }
+    if (device < 0) return;
+
+    if (json[result].value.integer) {
+        // The server side deadline does the job, as before.
+        Devices[device].countdown = KASA_COUNTDOWN_NONE;
+        housekasa_device_countdown_unsupported (device);
+    } else {
+        Devices[device].countdown = KASA_COUNTDOWN_SET;
     }
 }
 
 static void housekasa_device_response (ParserToken *json, int count,
                                        struct sockaddr_in *addr,
-                                       const char *data) {
+                                       int hasinfo, const char *data) {
 
     int result = echttp_json_search (json, ".system.set_relay_state.err_code");
     if (result >= 0) {
-        if (json[result].value.integer) return; // Error.
-
         int i;
+        int error = json[result].value.integer;
+
+        // The device is done with the command in flight, if the state was
+        // reached. Otherwise this acknowledges an earlier command, or the
+        // status comes later (separate requests): the command is then
+        // released on confirmation. Errors are handled by the retry timer.
+        //
+        if (housekasa_device_acknowledged (addr->sin_addr.s_addr))
+            housekasa_device_advance (addr->sin_addr.s_addr);
+        if (error) return;
+
         for (i = 0; i < DevicesCount; ++i) {
             if (addr->sin_addr.s_addr != Devices[i].ipaddress.sin_addr.s_addr)
                 continue;
 
+            // The new state was part of the response: nothing more to do.
+            if (hasinfo) break;
+
+            // This device's firmware did not process the combined request.
+            // From now on, use separate requests for that model.
+            //
+            if (housekasa_device_combined (i)) housekasa_device_separate (i);
+
             // The response does not include the current state of the device.
             // If this is a multi-plug device, we don't know which child
             // this is about.
             // The easiest is just to query the complete device state now.
             //
             housekasa_device_sense(&(Devices[i].ipaddress));
-            Devices[i].last_sense = time(0);
+            Devices[i].last_sense = housekasa_timer_now();
 
             break; // No point in requesting for another child.
         }
     }
 }
 
-static void housekasa_device_receive (int fd, int mode) {
+// A device answers each discovery broadcast, on every network it is
+// reachable from, as well as the unicast status requests. Its status is
+// almost always the same as in its previous reply, so the fingerprint of
+// the raw reply is compared first, which avoids decoding the JSON data.
+// The fields that change all the time without meaning a status change
+// (signal strength, time since on) are excluded from the fingerprint.
+//
+static const char *KasaVolatileFields[] = {"\"rssi\":", "\"on_time\":", 0};
+
+static unsigned long long housekasa_device_fingerprint (const char *data,
+                                                        int size, int *rssi) {
+    unsigned long long hash = 14695981039346656037ULL; // FNV-1a.
+    int i, j;
+
+    *rssi = 0;
+    for (i = 0; i < size; ++i) {
+        if (data[i] == '"') {
+            for (j = 0; KasaVolatileFields[j]; ++j) {
+                int length = strlen(KasaVolatileFields[j]);
+                if (strncmp (data+i, KasaVolatileFields[j], length)) continue;
+                i += length;
+                if (j == 0) *rssi = atoi (data+i); // Free: we are there.
+                while (i < size &&
+                       (data[i] == '-' || (data[i] >= '0' && data[i] <= '9')))
+                    i += 1;
+                break;
+            }
+            if (i >= size) break;
+        }
+        hash ^= (unsigned char)(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
 
-    char data[1500];
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
+// Return 1 if this reply is the same as the previous one from the same
+// address: then the devices are only marked as detected.
+//
+static int housekasa_device_unchanged (const struct sockaddr_in *source,
+                                       unsigned long long fingerprint,
+                                       int rssi) {
+    int i;
+    int found = 0;
+    for (i = 0; i < DevicesCount; ++i) {
+        if (source->sin_addr.s_addr != Devices[i].ipaddress.sin_addr.s_addr)
+            continue;
+        if (!housekasa_shard_owned (Devices[i].id)) return 1; // Not ours.
+        if (Devices[i].fingerprint != fingerprint) return 0;
+        if (!Devices[i].detected) return 0;
+        found = 1;
+    }
+    if (!found) return 0;
 
-    int size = recvfrom (KasaSocket, data, sizeof(data)-1, 0,
-                         (struct sockaddr *)(&addr), &addrlen);
-    if (size > 0) {
-        int i;
-        int key = 0xab;
-        for (i = 0; i < size; ++i) {
-            char tmp = data[i];
-            data[i] = key ^ data[i];
-            key = tmp;
-        }
-        data[size] = 0;
-        if (echttp_isdebug()) fprintf (stderr, "Received: %s\n", data);
+    long long now = housekasa_timer_now();
+    for (i = 0; i < DevicesCount; ++i) {
+        if (source->sin_addr.s_addr != Devices[i].ipaddress.sin_addr.s_addr)
+            continue;
+        Devices[i].detected = now;
+        if (rssi) Devices[i].info.rssi = rssi;
+    }
+    housekasa_metrics_increment (KASA_METRIC_UNCHANGED);
+    return 1;
+}
 
-        ParserToken json[256];
-        int jsoncount = 256;
+static void housekasa_device_fingerprint_set (const struct sockaddr_in *source,
+                                              unsigned long long fingerprint) {
+    int i;
+    for (i = 0; i < DevicesCount; ++i) {
+        if (source->sin_addr.s_addr == Devices[i].ipaddress.sin_addr.s_addr)
+            Devices[i].fingerprint = fingerprint;
+    }
+}
 
-        // We need to copy to preserve the original data (JSON decoding is
-        // destructive).
-        //
-        char buffer[1500];
-        strtcpy (buffer, data, sizeof(buffer));
+// Return the index of the set_brightness error code, or -1 if none.
+// The dimmer module's name contains dots, which echttp_json_search()
+// would take as path separators: find the module item first, then
+// search its own subtree.
+//
+static int housekasa_device_dimmer_ack (const ParserToken *json, int count) {
+    int i;
+    for (i = 1; i < count; ++i) {
+        if (json[i].type != PARSER_OBJECT) continue;
+        if (!json[i].key) continue;
+        if (strcmp (json[i].key, "smartlife.iot.dimmer")) continue;
+        int result = echttp_json_search (json+i, ".set_brightness.err_code");
+        if (result < 0) return -1;
+        if (json[i+result].type != PARSER_INTEGER) return -1;
+        return i + result;
+    }
+    return -1;
+}
+
+static void housekasa_device_receive (char *data, int size,
+                                      const struct sockaddr_in *source,
+                                      int ifindex) {
+
+    struct sockaddr_in addr = *source;
 
-        const char *error = echttp_json_parse (buffer, json, &jsoncount);
-        if (error) {
-            houselog_trace (HOUSE_FAILURE, "DEVICE", "%s: %s", error, data);
+    if (!ifindex) ifindex = housekasa_device_attribute (source);
+
+    // Only pure status replies are eligible: a reply to a control
+    // always needs to be processed.
+    //
+    static const char sysinfo[] = "{\"system\":{\"get_sysinfo\":";
+    unsigned long long fingerprint = 0;
+    if (!strncmp (data, sysinfo, sizeof(sysinfo)-1)) {
+        int rssi;
+        fingerprint = housekasa_device_fingerprint (data, size, &rssi);
+        if (housekasa_device_unchanged (source, fingerprint, rssi)) {
+            housekasa_replay_stage (KASA_REPLAY_FILTER);
             return;
         }
+    }
+    housekasa_replay_stage (KASA_REPLAY_FILTER);
 
-        int response = echttp_json_search (json, ".system.get_sysinfo");
-        if (response >= 0) {
-            housekasa_device_getinfo (json, jsoncount, &addr, data);
-        } else {
-            response = echttp_json_search (json, ".system.set_relay_state");
-            if (response >= 0) {
-                housekasa_device_response (json, jsoncount, &addr, data);
-            }
+    if (echttp_isdebug()) fprintf (stderr, "Received: %s\n", data);
+
+    ParserToken json[256];
+    int jsoncount = 256;
+
+    // We need to copy to preserve the original data (JSON decoding is
+    // destructive).
+    //
+    char buffer[1500];
+    strtcpy (buffer, data, sizeof(buffer));
+
+    const char *error = echttp_json_parse (buffer, json, &jsoncount);
+    housekasa_replay_stage (KASA_REPLAY_PARSE);
+    if (error) {
+        housekasa_metrics_increment (KASA_METRIC_PARSEERROR);
+        houselog_trace (HOUSE_FAILURE, "DEVICE", "%s: %s", error, data);
+        return;
+    }
+
+    int dimmer = housekasa_device_dimmer_ack (json, jsoncount);
+    if (dimmer >= 0) {
+        int i;
+        for (i = 0; i < DevicesCount; ++i) {
+            if (addr.sin_addr.s_addr != Devices[i].ipaddress.sin_addr.s_addr)
+                continue;
+            housekasa_device_dim_acknowledged
+                (i, (int)(json[dimmer].value.integer));
+            break;
+        }
+    }
+
+    // The response to a control may also include the device status,
+    // if the control was combined with a get_sysinfo request.
+    //
+    int control = echttp_json_search (json, ".system.set_relay_state");
+    int hasinfo =
+        (echttp_json_search (json, ".system.get_sysinfo.deviceId") >= 0);
+
+    if (control >= 0) housekasa_device_countdown_response (json, &addr);
+
+    if (hasinfo || (control < 0)) {
+        if (echttp_json_search (json, ".system.get_sysinfo") >= 0) {
+            housekasa_device_getinfo (json, jsoncount, &addr, ifindex, data);
+            // Forget the previous fingerprint if this reply has none:
+            // the status may have changed since.
+            housekasa_device_fingerprint_set (&addr, fingerprint);
         }
     }
+    if (control >= 0) {
+        housekasa_device_response (json, jsoncount, &addr, hasinfo, data);
+    }
 }
 
 const char *housekasa_device_initialize
                 (int argc, const char **argv, int livestate) {
 
+    int i;
+    const char *value;
+
     LiveState = livestate;
 
-    housekasa_device_socket ();
-    echttp_listen (KasaSocket, 1, housekasa_device_receive, 0);
-    return housekasa_device_refresh ();
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-kasa-poll-rate=", argv[i], &value)) {
+            KasaPollRate = atoi(value);
+            if (KasaPollRate < 1) KasaPollRate = 1;
+        }
+        echttp_option_match ("-kasa-snapshot=", argv[i], &KasaSnapshotPath);
+    }
+
+    const char *error =
+        housekasa_io_initialize (argc, argv, housekasa_device_receive);
+    if (error) return error;
+
+    housekasa_device_interfaces_watch ();
+
+    error = housekasa_device_refresh ();
+    if (error) return error;
+
+    // A replay starts from the configuration only, so that its results
+    // do not depend on the state of the live service.
+    if (KasaSnapshotPath[0] && !housekasa_replay_active())
+        housekasa_device_snapshot_load ();
+    return 0;
 }
 
@@ -32,14 +32,26 @@ const char *housekasa_device_name (int point);
 
 const char *housekasa_device_live_config (char *buffer, int size);
 
+const char *housekasa_device_inventory (int point, char *buffer, int size);
+
 const char *housekasa_device_failure (int point);
+int housekasa_device_owned (int point);
+int housekasa_device_stale (int point);
 
 int    housekasa_device_commanded (int point);
 time_t housekasa_device_deadline  (int point);
 int    housekasa_device_priority  (int point);
 int    housekasa_device_get       (int point);
+int    housekasa_device_brightness (int point);
+int    housekasa_device_set_brightness (int point, int level,
+                                        const char *cause);
+int    housekasa_device_rtt       (int point);
+int    housekasa_device_age       (int point);
 void   housekasa_device_set       (int point, int state,
                                    int pulse, const char *cause);
 
+void housekasa_device_batch_start (void);
+void housekasa_device_batch_flush (void);
+
 void housekasa_device_periodic (time_t now);
 
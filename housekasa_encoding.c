@@ -0,0 +1,250 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housekasa_encoding.c - Compressed and conditional HTTP responses.
+ *
+ * SYNOPSYS:
+ *
+ * int housekasa_encoding_declare (void);
+ *
+ *    Declare a new response cache. Return the cache identifier.
+ *
+ * int housekasa_encoding_current (int cache, long long key);
+ *
+ *    Return true if the cache already holds the response for the specified
+ *    key, in which case there is no need to build the response again.
+ *    The key is typically derived from a housestate version.
+ *
+ * void housekasa_encoding_store (int cache, long long key, const char *body);
+ *
+ *    Store a new response in the cache. Any compressed copy of the previous
+ *    response is discarded.
+ *
+ * int housekasa_encoding_unmodified (const char *etag);
+ *
+ *    Set the ETag header of the response, and return true if the client
+ *    already has this version (If-None-Match). The caller should then
+ *    reply with a 304 status, without data.
+ *
+ * const char *housekasa_encoding_reply (int cache);
+ *
+ *    Return the cached response, compressed if the client accepts gzip
+ *    or deflate (Accept-Encoding). The compressed copy is created only once
+ *    for each response, and is then shared by all clients.
+ *
+ * const char *housekasa_encoding_asset (const char *root, const char *uri);
+ *
+ *    Serve a static file, using the precompressed copy (same name, with
+ *    a .gz suffix) if there is one and the client accepts gzip. The ETag
+ *    is derived from the file's modification time and size.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "echttp.h"
+
+#include "housekasa_encoding.h"
+
+#define KASA_ENCODING_GZIP    0
+#define KASA_ENCODING_DEFLATE 1
+#define KASA_ENCODING_COUNT   2
+
+static const char *KasaEncodingNames[KASA_ENCODING_COUNT] = {"gzip", "deflate"};
+static const int KasaEncodingWindow[KASA_ENCODING_COUNT] = {15+16, 15};
+
+#define KASA_ENCODING_MIN 256 // Smaller responses are not worth it.
+
+struct EncodingCache {
+    long long key;
+    int valid;
+    char *plain;
+    int length;
+    char *encoded[KASA_ENCODING_COUNT];
+    int encodedlength[KASA_ENCODING_COUNT];
+};
+
+#define KASA_ENCODING_CACHES 8
+static struct EncodingCache EncodingCaches[KASA_ENCODING_CACHES];
+static int EncodingCachesCount = 0;
+
+int housekasa_encoding_declare (void) {
+    if (EncodingCachesCount >= KASA_ENCODING_CACHES) return -1;
+    return EncodingCachesCount++;
+}
+
+int housekasa_encoding_current (int cache, long long key) {
+    if (cache < 0 || cache >= EncodingCachesCount) return 0;
+    return EncodingCaches[cache].valid && (EncodingCaches[cache].key == key);
+}
+
+void housekasa_encoding_store (int cache, long long key, const char *body) {
+
+    int i;
+    if (cache < 0 || cache >= EncodingCachesCount) return;
+    struct EncodingCache *entry = EncodingCaches + cache;
+
+    for (i = 0; i < KASA_ENCODING_COUNT; ++i) {
+        free (entry->encoded[i]);
+        entry->encoded[i] = 0;
+        entry->encodedlength[i] = 0;
+    }
+    if (entry->plain != body) {
+        free (entry->plain);
+        entry->plain = strdup (body);
+    }
+    entry->length = strlen (body);
+    entry->key = key;
+    entry->valid = 1;
+}
+
+// Return true if the client accepts this encoding. An encoding with
+// a quality of 0 is explicitly refused.
+//
+static int housekasa_encoding_accepted (const char *name) {
+
+    const char *accepted = echttp_attribute_get ("Accept-Encoding");
+    if (!accepted) return 0;
+
+    const char *found = strstr (accepted, name);
+    if (!found) return 0;
+    found += strlen(name);
+    while (*found == ' ') found += 1;
+    if (*found == ';') {
+        const char *q = strstr (found, "q=");
+        if (q && (atof(q+2) <= 0.0)) return 0;
+    }
+    return 1;
+}
+
+static int housekasa_encoding_compress (struct EncodingCache *entry, int type) {
+
+    if (entry->encoded[type]) return entry->encodedlength[type];
+
+    z_stream stream;
+    memset (&stream, 0, sizeof(stream));
+    if (deflateInit2 (&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                      KasaEncodingWindow[type], 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    int size = deflateBound (&stream, entry->length);
+    char *buffer = malloc (size);
+    stream.next_in = (Bytef *)(entry->plain);
+    stream.avail_in = entry->length;
+    stream.next_out = (Bytef *)buffer;
+    stream.avail_out = size;
+    int status = deflate (&stream, Z_FINISH);
+    deflateEnd (&stream);
+    if (status != Z_STREAM_END) {
+        free (buffer);
+        return 0;
+    }
+    entry->encoded[type] = buffer;
+    entry->encodedlength[type] = size - stream.avail_out;
+    return entry->encodedlength[type];
+}
+
+int housekasa_encoding_unmodified (const char *etag) {
+
+    echttp_attribute_set ("ETag", etag);
+
+    const char *known = echttp_attribute_get ("If-None-Match");
+    if (!known) return 0;
+    return (strstr (known, etag) != 0) || (!strcmp (known, "*"));
+}
+
+const char *housekasa_encoding_reply (int cache) {
+
+    int type;
+    if (cache < 0 || cache >= EncodingCachesCount) return "";
+    struct EncodingCache *entry = EncodingCaches + cache;
+    if (!entry->valid) return "";
+
+    echttp_attribute_set ("Vary", "Accept-Encoding");
+    if (entry->length < KASA_ENCODING_MIN) return entry->plain;
+
+    for (type = 0; type < KASA_ENCODING_COUNT; ++type) {
+        if (!housekasa_encoding_accepted (KasaEncodingNames[type])) continue;
+        int length = housekasa_encoding_compress (entry, type);
+        if (length <= 0) continue;
+        echttp_attribute_set ("Content-Encoding", KasaEncodingNames[type]);
+        echttp_content_length (length);
+        return entry->encoded[type];
+    }
+    return entry->plain;
+}
+
+const char *housekasa_encoding_asset (const char *root, const char *uri) {
+
+    char path[1024];
+    char etag[64];
+    struct stat info;
+    int fd = -1;
+    int compressed = 0;
+
+    if (strstr (uri, "..")) {
+        echttp_error (403, "Forbidden");
+        return "";
+    }
+    snprintf (path, sizeof(path), "%s%s", root, uri);
+
+    echttp_attribute_set ("Vary", "Accept-Encoding");
+    if (housekasa_encoding_accepted ("gzip")) {
+        char gzpath[1100];
+        snprintf (gzpath, sizeof(gzpath), "%s.gz", path);
+        fd = open (gzpath, O_RDONLY);
+        if (fd >= 0) compressed = 1;
+    }
+    if (fd < 0) fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    if (fstat (fd, &info) < 0) {
+        close (fd);
+        echttp_error (500, "Cannot access file");
+        return "";
+    }
+
+    snprintf (etag, sizeof(etag), "W/\"%lx-%lx\"",
+              (long)info.st_mtime, (long)info.st_size);
+    if (housekasa_encoding_unmodified (etag)) {
+        close (fd);
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+
+    if (compressed) echttp_attribute_set ("Content-Encoding", "gzip");
+    if (strstr (uri, ".html")) echttp_content_type_html ();
+    else if (strstr (uri, ".css")) echttp_content_type_set ("text/css");
+    else if (strstr (uri, ".js")) echttp_content_type_set ("application/javascript");
+    echttp_transfer (fd, info.st_size);
+    return "";
+}
+
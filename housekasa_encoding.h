@@ -0,0 +1,34 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_encoding.h - Compressed and conditional HTTP responses.
+ *
+ */
+int  housekasa_encoding_declare (void);
+
+int  housekasa_encoding_current (int cache, long long key);
+void housekasa_encoding_store   (int cache, long long key, const char *body);
+
+int  housekasa_encoding_unmodified (const char *etag);
+
+const char *housekasa_encoding_reply (int cache);
+
+const char *housekasa_encoding_asset (const char *root, const char *uri);
+
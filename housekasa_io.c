@@ -0,0 +1,511 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_io.c - The UDP transport used to talk to Kasa devices.
+ *
+ * SYNOPSYS:
+ *
+ * const char *housekasa_io_initialize (int argc, const char **argv,
+ *                                      housekasa_io_receiver *receiver);
+ *
+ *    Open the UDP socket and start listening. The receiver function is
+ *    called from the echttp loop for every datagram received, after it
+ *    has been decrypted. The receiver is also given the index of the
+ *    network interface the datagram came from (0 if not known).
+ *
+ *    If the -kasa-io-thread option is present, the socket is owned by
+ *    a dedicated I/O thread that performs the send, receive, encryption
+ *    and decryption work. This thread exchanges datagrams with the echttp
+ *    loop through two single-producer single-consumer rings, the echttp
+ *    side being woken up by an eventfd. This way device traffic is not
+ *    delayed when the echttp loop is busy saving the configuration or
+ *    flushing logs.
+ *
+ *    In replay mode, only the receiver is registered: the socket is not
+ *    opened, and the I/O thread is not started.
+ *
+ *    The socket receive buffer size can be set using the -kasa-rcvbuf=N
+ *    option (in bytes, default: the system default). It is doubled each
+ *    time the kernel drops datagrams, up to the -kasa-rcvbuf-max=N limit
+ *    (default: 4 MB).
+ *
+ * int housekasa_io_threaded (void);
+ *
+ *    Return true if the I/O thread is in use.
+ *
+ * int housekasa_io_overflows (void);
+ *
+ *    Return the number of datagrams that the kernel dropped since
+ *    the previous call, because the socket receive buffer was full
+ *    (as reported by SO_RXQ_OVFL). The receive buffer is enlarged if
+ *    datagrams were dropped. This must be called from the echttp loop.
+ *
+ * void housekasa_io_send (const struct sockaddr_in *a, const char *data);
+ *
+ *    Encrypt and send one command to the specified address. Nothing is
+ *    sent in replay mode.
+ *
+ * void housekasa_io_replay (char *data, int length,
+ *                           const struct sockaddr_in *addr, int ifindex);
+ *
+ *    Process one datagram from a capture file, as if it was just received.
+ *    The data buffer must have room for one more character.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "housekasa_metrics.h"
+#include "housekasa_replay.h"
+#include "housekasa_io.h"
+
+static int KasaDevicePort = 9999;
+static int KasaSocket = -1;
+
+static housekasa_io_receiver *KasaReceiver = 0;
+
+// The kernel counts the datagrams dropped because the socket buffer was
+// full, and reports the running total with each datagram received.
+//
+static int KasaReceiveBuffer = 0; // 0: system default.
+static int KasaReceiveBufferMax = 4 * 1024 * 1024;
+
+static atomic_uint KasaOverflowTotal;
+static unsigned int KasaOverflowReported = 0;
+
+#define KASAIOMTU 1500
+
+static void housekasa_io_encrypt (char *encoded, const char *d, int length) {
+    int i;
+    char key = 0xab;
+    for (i = 0; i < length; ++i) {
+        key = encoded[i] = key ^ d[i];
+    }
+}
+
+static void housekasa_io_decrypt (char *data, int size) {
+    int i;
+    int key = 0xab;
+    for (i = 0; i < size; ++i) {
+        char tmp = data[i];
+        data[i] = key ^ data[i];
+        key = tmp;
+    }
+    data[size] = 0;
+}
+
+// The I/O thread data. Each ring has exactly one producer and one consumer,
+// so that a pair of atomic indexes is all the synchronization needed.
+//
+#define KASARINGSIZE 256 // Must be a power of 2.
+
+struct KasaDatagram {
+    struct sockaddr_in addr;
+    int ifindex;
+    int length;
+    char data[KASAIOMTU+1];
+};
+
+struct KasaRing {
+    atomic_uint produced;
+    atomic_uint consumed;
+    struct KasaDatagram slot[KASARINGSIZE];
+};
+
+static int KasaThreaded = 0;
+static pthread_t KasaThread;
+
+static struct KasaRing *KasaReceived = 0; // I/O thread --> echttp loop.
+static struct KasaRing *KasaToSend = 0;   // echttp loop --> I/O thread.
+
+static int KasaReceivedEvent = -1;
+static int KasaToSendEvent = -1;
+
+static atomic_uint KasaReceivedDropped;
+static atomic_uint KasaToSendDropped;
+
+// The I/O thread does not log anything itself (houselog is not thread safe):
+// it only records the errors, which are reported later by the echttp loop.
+//
+static atomic_uint KasaSendErrors;
+static atomic_int  KasaSendErrno;
+
+static struct KasaDatagram *housekasa_io_ring_reserve (struct KasaRing *ring) {
+    unsigned int produced =
+        atomic_load_explicit (&(ring->produced), memory_order_relaxed);
+    unsigned int consumed =
+        atomic_load_explicit (&(ring->consumed), memory_order_acquire);
+    if (produced - consumed >= KASARINGSIZE) return 0; // Full.
+    return ring->slot + (produced & (KASARINGSIZE - 1));
+}
+
+static void housekasa_io_ring_commit (struct KasaRing *ring) {
+    atomic_fetch_add_explicit (&(ring->produced), 1, memory_order_release);
+}
+
+static struct KasaDatagram *housekasa_io_ring_peek (struct KasaRing *ring) {
+    unsigned int consumed =
+        atomic_load_explicit (&(ring->consumed), memory_order_relaxed);
+    unsigned int produced =
+        atomic_load_explicit (&(ring->produced), memory_order_acquire);
+    if (produced == consumed) return 0; // Empty.
+    return ring->slot + (consumed & (KASARINGSIZE - 1));
+}
+
+static void housekasa_io_ring_release (struct KasaRing *ring) {
+    atomic_fetch_add_explicit (&(ring->consumed), 1, memory_order_release);
+}
+
+static void housekasa_io_signal (int fd) {
+    uint64_t one = 1;
+    if (write (fd, &one, sizeof(one)) < 0) {
+        // EAGAIN means that the counter is saturated: already signaled.
+    }
+}
+
+static void housekasa_io_acknowledge (int fd) {
+    uint64_t count;
+    if (read (fd, &count, sizeof(count)) < 0) {
+        // EAGAIN means that there was nothing to acknowledge.
+    }
+}
+
+static void housekasa_io_transmit (const struct sockaddr_in *a,
+                                   const char *d, int length) {
+
+    char encoded[KASAIOMTU];
+    housekasa_io_encrypt (encoded, d, length);
+    int sent = sendto (KasaSocket, encoded, length, 0,
+                       (struct sockaddr *)a, sizeof(struct sockaddr_in));
+    if (sent < 0) {
+        atomic_store (&KasaSendErrno, errno);
+        atomic_fetch_add (&KasaSendErrors, 1);
+        housekasa_metrics_increment (KASA_METRIC_SENDERROR);
+    } else {
+        housekasa_metrics_increment (KASA_METRIC_SENT);
+    }
+}
+
+static void housekasa_io_report (void) {
+
+    unsigned int count = atomic_exchange (&KasaSendErrors, 0);
+    if (count)
+        houselog_trace (HOUSE_FAILURE, "DEVICE", "sendto() error: %s (%u times)",
+                        strerror(atomic_load (&KasaSendErrno)), count);
+    count = atomic_exchange (&KasaReceivedDropped, 0);
+    if (count)
+        houselog_trace (HOUSE_FAILURE, "DEVICE",
+                        "%u datagrams dropped (receive queue full)", count);
+    count = atomic_exchange (&KasaToSendDropped, 0);
+    if (count)
+        houselog_trace (HOUSE_FAILURE, "DEVICE",
+                        "%u datagrams dropped (send queue full)", count);
+}
+
+void housekasa_io_send (const struct sockaddr_in *a, const char *d) {
+    if (housekasa_replay_active()) return; // Do not disturb the devices.
+    if (echttp_isdebug()) {
+        long ip = ntohl((long)(a->sin_addr.s_addr));
+        int port = ntohs(a->sin_port);
+        printf ("Sending packet to %ld.%ld.%ld.%ld(port %d): %s\n",
+                (ip>>24)&0xff, (ip>>16)&0xff, (ip>>8)&0xff, ip&0xff, port, d);
+    }
+    int length = strlen(d);
+    if (length > KASAIOMTU) {
+        houselog_trace (HOUSE_FAILURE, "INTERNAL",
+                        "Encoding buffer too small: has %d, needs %d",
+                        KASAIOMTU, length);
+        return;
+    }
+    housekasa_io_report ();
+    if (!KasaThreaded) {
+        housekasa_io_transmit (a, d, length);
+        return;
+    }
+    struct KasaDatagram *datagram = housekasa_io_ring_reserve (KasaToSend);
+    if (!datagram) {
+        housekasa_metrics_increment (KASA_METRIC_QUEUEDROP);
+        atomic_fetch_add (&KasaToSendDropped, 1);
+        return;
+    }
+    datagram->addr = *a;
+    datagram->length = length;
+    memcpy (datagram->data, d, length);
+    housekasa_io_ring_commit (KasaToSend);
+    housekasa_io_signal (KasaToSendEvent);
+}
+
+static int housekasa_io_read (struct KasaDatagram *datagram) {
+
+    struct iovec io;
+    struct msghdr header;
+    char control[256];
+
+    io.iov_base = datagram->data;
+    io.iov_len = KASAIOMTU;
+    memset (&header, 0, sizeof(header));
+    header.msg_name = &(datagram->addr);
+    header.msg_namelen = sizeof(datagram->addr);
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    int size = recvmsg (KasaSocket, &header, MSG_DONTWAIT);
+    if (size <= 0) return 0;
+
+    // Retrieve which interface the datagram was received from.
+    //
+    datagram->ifindex = 0;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&header);
+         cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if ((cmsg->cmsg_level == IPPROTO_IP) &&
+            (cmsg->cmsg_type == IP_PKTINFO)) {
+            struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            datagram->ifindex = info->ipi_ifindex;
+        } else if ((cmsg->cmsg_level == SOL_SOCKET) &&
+                   (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+            uint32_t total;
+            memcpy (&total, CMSG_DATA(cmsg), sizeof(total));
+            atomic_store (&KasaOverflowTotal, total);
+        }
+    }
+    housekasa_metrics_increment (KASA_METRIC_RECEIVED);
+    housekasa_replay_capture (datagram->data, size,
+                              &(datagram->addr), datagram->ifindex);
+    housekasa_io_decrypt (datagram->data, size);
+    datagram->length = size;
+    return 1;
+}
+
+static void housekasa_io_receive (int fd, int mode) {
+
+    struct KasaDatagram datagram;
+
+    if (housekasa_io_read (&datagram))
+        KasaReceiver (datagram.data, datagram.length,
+                      &(datagram.addr), datagram.ifindex);
+}
+
+void housekasa_io_replay (char *data, int length,
+                          const struct sockaddr_in *addr, int ifindex) {
+    housekasa_io_decrypt (data, length);
+    housekasa_replay_stage (KASA_REPLAY_DECRYPT);
+    KasaReceiver (data, length, addr, ifindex);
+}
+
+static void housekasa_io_deliver (int fd, int mode) {
+
+    housekasa_io_acknowledge (KasaReceivedEvent);
+
+    struct KasaDatagram *datagram;
+    while ((datagram = housekasa_io_ring_peek (KasaReceived)) != 0) {
+        KasaReceiver (datagram->data, datagram->length,
+                      &(datagram->addr), datagram->ifindex);
+        housekasa_io_ring_release (KasaReceived);
+    }
+    housekasa_io_report ();
+}
+
+static void *housekasa_io_thread (void *context) {
+
+    struct pollfd watch[2];
+
+    watch[0].fd = KasaSocket;
+    watch[0].events = POLLIN;
+    watch[1].fd = KasaToSendEvent;
+    watch[1].events = POLLIN;
+
+    for (;;) {
+        if (poll (watch, 2, -1) < 0) continue; // EINTR.
+
+        if (watch[1].revents & POLLIN) {
+            housekasa_io_acknowledge (KasaToSendEvent);
+            struct KasaDatagram *datagram;
+            while ((datagram = housekasa_io_ring_peek (KasaToSend)) != 0) {
+                housekasa_io_transmit
+                    (&(datagram->addr), datagram->data, datagram->length);
+                housekasa_io_ring_release (KasaToSend);
+            }
+        }
+
+        if (watch[0].revents & POLLIN) {
+            int received = 0;
+            for (;;) {
+                struct KasaDatagram *datagram =
+                    housekasa_io_ring_reserve (KasaReceived);
+                if (!datagram) {
+                    // Drain the socket anyway, the consumer is too late.
+                    struct KasaDatagram discard;
+                    if (!housekasa_io_read (&discard)) break;
+                    housekasa_metrics_increment (KASA_METRIC_QUEUEDROP);
+                    atomic_fetch_add (&KasaReceivedDropped, 1);
+                    continue;
+                }
+                if (!housekasa_io_read (datagram)) break;
+                housekasa_io_ring_commit (KasaReceived);
+                received += 1;
+            }
+            if (received) housekasa_io_signal (KasaReceivedEvent);
+        }
+    }
+    return 0;
+}
+
+static const char *housekasa_io_start (void) {
+
+    KasaReceived = calloc (1, sizeof(struct KasaRing));
+    KasaToSend = calloc (1, sizeof(struct KasaRing));
+    if ((!KasaReceived) || (!KasaToSend)) return "no more memory";
+
+    KasaReceivedEvent = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    KasaToSendEvent = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if ((KasaReceivedEvent < 0) || (KasaToSendEvent < 0))
+        return "cannot create eventfd";
+
+    KasaThreaded = 1;
+    if (pthread_create (&KasaThread, 0, housekasa_io_thread, 0)) {
+        KasaThreaded = 0;
+        return "cannot create the I/O thread";
+    }
+    echttp_listen (KasaReceivedEvent, 1, housekasa_io_deliver, 1);
+    houselog_trace (HOUSE_INFO, "DEVICE", "I/O thread started");
+    return 0;
+}
+
+int housekasa_io_threaded (void) {
+    return KasaThreaded;
+}
+
+static void housekasa_io_rcvbuf (int size) {
+
+    // The forced variant ignores the system limit, but requires
+    // the CAP_NET_ADMIN capability.
+    //
+    if ((setsockopt (KasaSocket, SOL_SOCKET, SO_RCVBUFFORCE,
+                     &size, sizeof(size)) < 0) &&
+        (setsockopt (KasaSocket, SOL_SOCKET, SO_RCVBUF,
+                     &size, sizeof(size)) < 0)) {
+        houselog_trace (HOUSE_WARNING, "SOCKET",
+                        "cannot set the receive buffer: %s", strerror(errno));
+        return;
+    }
+    KasaReceiveBuffer = size;
+    houselog_trace (HOUSE_INFO, "SOCKET", "receive buffer set to %d bytes", size);
+}
+
+int housekasa_io_overflows (void) {
+
+    unsigned int total = atomic_load (&KasaOverflowTotal);
+    int dropped = (int)(total - KasaOverflowReported);
+    if (dropped <= 0) return 0;
+    KasaOverflowReported = total;
+
+    housekasa_metrics_add (KASA_METRIC_OVERFLOW, dropped);
+    houselog_trace (HOUSE_WARNING, "SOCKET",
+                    "%d datagrams dropped (socket buffer full)", dropped);
+
+    if (KasaReceiveBuffer < KasaReceiveBufferMax) {
+        int size = KasaReceiveBuffer;
+        if (!size) {
+            socklen_t length = sizeof(size);
+            if (getsockopt (KasaSocket, SOL_SOCKET, SO_RCVBUF,
+                            &size, &length) < 0) return dropped;
+            size /= 2; // Linux reports twice the size that was set.
+        }
+        size *= 2;
+        if (size > KasaReceiveBufferMax) size = KasaReceiveBufferMax;
+        housekasa_io_rcvbuf (size);
+    }
+    return dropped;
+}
+
+const char *housekasa_io_initialize (int argc, const char **argv,
+                                     housekasa_io_receiver *receiver) {
+    int i;
+    int threaded = 0;
+    int buffer = 0;
+    const char *option;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-kasa-io-thread", argv[i])) threaded = 1;
+        else if (echttp_option_match ("-kasa-rcvbuf=", argv[i], &option))
+            buffer = atoi(option);
+        else if (echttp_option_match ("-kasa-rcvbuf-max=", argv[i], &option))
+            KasaReceiveBufferMax = atoi(option);
+    }
+
+    KasaReceiver = receiver;
+
+    // In replay mode the datagrams come from the capture file: there is
+    // no socket, and no I/O thread.
+    if (housekasa_replay_active()) return 0;
+
+    KasaSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (KasaSocket < 0) {
+        houselog_trace (HOUSE_FAILURE, "DEVICE",
+                        "cannot open UDP socket: %s", strerror(errno));
+        exit(1);
+    }
+
+    int value = 1;
+    if (setsockopt(KasaSocket, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "SOCKET",
+                        "cannot broadcast: %s", strerror(errno));
+        exit(1);
+    }
+
+    if (setsockopt(KasaSocket, IPPROTO_IP, IP_PKTINFO, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_WARNING, "SOCKET",
+                        "cannot get interface info: %s", strerror(errno));
+    }
+
+    if (setsockopt(KasaSocket, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_WARNING, "SOCKET",
+                        "cannot count dropped datagrams: %s", strerror(errno));
+    }
+    if (buffer > 0) housekasa_io_rcvbuf (buffer);
+
+    houselog_trace (HOUSE_INFO, "DEVICE", "UDP port %d is now open", KasaDevicePort);
+
+    if (threaded) return housekasa_io_start ();
+
+    echttp_listen (KasaSocket, 1, housekasa_io_receive, 0);
+    return 0;
+}
+
@@ -0,0 +1,41 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_io.h - The UDP transport used to talk to Kasa devices.
+ *
+ */
+struct sockaddr_in;
+
+typedef void housekasa_io_receiver (char *data, int length,
+                                    const struct sockaddr_in *addr,
+                                    int ifindex);
+
+const char *housekasa_io_initialize (int argc, const char **argv,
+                                     housekasa_io_receiver *receiver);
+
+int  housekasa_io_threaded (void);
+
+int  housekasa_io_overflows (void);
+
+void housekasa_io_send (const struct sockaddr_in *a, const char *data);
+
+void housekasa_io_replay (char *data, int length,
+                          const struct sockaddr_in *addr, int ifindex);
+
@@ -0,0 +1,165 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_metrics.c - Protocol and device counters.
+ *
+ * SYNOPSYS:
+ *
+ * void housekasa_metrics_increment (int counter);
+ * void housekasa_metrics_add (int counter, int value);
+ *
+ *    Count one or more occurrences of the specified event. The counters
+ *    are lock-free, so that these functions can be called from the I/O
+ *    thread as well as from the echttp loop.
+ *
+ * const char *housekasa_metrics_export (char *buffer, int size);
+ *
+ *    Format all counters in the Prometheus text format, followed with
+ *    histograms of the device round trip times and last-seen ages.
+ *    Return the buffer, or a null pointer if the buffer is too small.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "housekasa_device.h"
+#include "housekasa_metrics.h"
+
+static atomic_ulong KasaMetrics[KASA_METRIC_COUNT];
+
+static const struct {
+    const char *name;
+    const char *help;
+} KasaMetricsNames[KASA_METRIC_COUNT] = {
+    {"kasa_datagrams_sent_total", "Datagrams sent to devices."},
+    {"kasa_datagrams_received_total", "Datagrams received from devices."},
+    {"kasa_send_errors_total", "Datagrams that could not be sent."},
+    {"kasa_queue_drops_total", "Datagrams dropped by the I/O thread queues."},
+    {"kasa_parse_errors_total", "Datagrams received with invalid JSON data."},
+    {"kasa_nospace_drops_total", "Devices ignored because the device list is full."},
+    {"kasa_retries_total", "Commands sent again after a timeout."},
+    {"kasa_timeouts_total", "Commands abandoned without confirmation."},
+    {"kasa_silent_total", "Devices that stopped responding."},
+    {"kasa_sysinfo_unchanged_total", "Status replies identical to the previous one."},
+    {"kasa_polls_deferred_total", "Status requests delayed by the polling budget."},
+    {"kasa_commands_superseded_total", "Queued commands replaced by a newer one before being sent."},
+    {"kasa_socket_overflows_total", "Datagrams dropped by the kernel because the socket buffer was full."}
+};
+
+// Histograms bucket limits, in milliseconds for RTT, seconds for age.
+static const int KasaRttBuckets[] = {25, 50, 100, 200, 500, 1000, 2000, 0};
+static const int KasaAgeBuckets[] = {5, 15, 30, 60, 120, 300, 0};
+
+void housekasa_metrics_increment (int counter) {
+    if (counter < 0 || counter >= KASA_METRIC_COUNT) return;
+    atomic_fetch_add_explicit (KasaMetrics+counter, 1, memory_order_relaxed);
+}
+
+void housekasa_metrics_add (int counter, int value) {
+    if (counter < 0 || counter >= KASA_METRIC_COUNT) return;
+    atomic_fetch_add_explicit (KasaMetrics+counter, value, memory_order_relaxed);
+}
+
+static int housekasa_metrics_histogram (char *buffer, int size,
+                                        const char *name, const char *help,
+                                        const int *limits,
+                                        int (*value) (int point)) {
+    int cursor;
+    int i, b;
+    int count = housekasa_device_count();
+    long long sum = 0;
+    int samples = 0;
+    int buckets[16];
+
+    memset (buckets, 0, sizeof(buckets));
+    for (i = 0; i < count; ++i) {
+        int v = value(i);
+        if (v < 0) continue; // No data for this device.
+        samples += 1;
+        sum += v;
+        for (b = 0; limits[b] > 0; ++b) {
+            if (v <= limits[b]) buckets[b] += 1;
+        }
+    }
+
+    cursor = snprintf (buffer, size,
+                       "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (b = 0; limits[b] > 0; ++b) {
+        if (cursor >= size) return cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s_bucket{le=\"%d\"} %d\n",
+                            name, limits[b], buckets[b]);
+    }
+    if (cursor >= size) return cursor;
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        "%s_bucket{le=\"+Inf\"} %d\n%s_sum %lld\n%s_count %d\n",
+                        name, samples, name, sum, name, samples);
+    return cursor;
+}
+
+const char *housekasa_metrics_export (char *buffer, int size) {
+
+    int i;
+    int cursor = 0;
+
+    for (i = 0; i < KASA_METRIC_COUNT; ++i) {
+        unsigned long value =
+            atomic_load_explicit (KasaMetrics+i, memory_order_relaxed);
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+                            KasaMetricsNames[i].name, KasaMetricsNames[i].help,
+                            KasaMetricsNames[i].name,
+                            KasaMetricsNames[i].name, value);
+        if (cursor >= size) return 0;
+    }
+
+    // The devices owned by other instances are never detected here.
+    int count = 0;
+    int silent = 0;
+    for (i = housekasa_device_count() - 1; i >= 0; --i) {
+        if (!housekasa_device_owned(i)) continue;
+        count += 1;
+        if (housekasa_device_failure(i)) silent += 1;
+    }
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        "# HELP kasa_devices Number of devices owned by this instance.\n"
+                        "# TYPE kasa_devices gauge\nkasa_devices %d\n"
+                        "# HELP kasa_devices_silent Number of devices not responding.\n"
+                        "# TYPE kasa_devices_silent gauge\nkasa_devices_silent %d\n",
+                        count, silent);
+    if (cursor >= size) return 0;
+
+    cursor += housekasa_metrics_histogram
+                  (buffer+cursor, size-cursor, "kasa_device_rtt_milliseconds",
+                   "Smoothed command round trip time of each device.",
+                   KasaRttBuckets, housekasa_device_rtt);
+    if (cursor >= size) return 0;
+
+    cursor += housekasa_metrics_histogram
+                  (buffer+cursor, size-cursor, "kasa_device_last_seen_seconds",
+                   "Time since each device last responded.",
+                   KasaAgeBuckets, housekasa_device_age);
+    if (cursor >= size) return 0;
+
+    return buffer;
+}
+
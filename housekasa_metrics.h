@@ -0,0 +1,43 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_metrics.h - Protocol and device counters.
+ *
+ */
+#define KASA_METRIC_SENT         0
+#define KASA_METRIC_RECEIVED     1
+#define KASA_METRIC_SENDERROR    2
+#define KASA_METRIC_QUEUEDROP    3
+#define KASA_METRIC_PARSEERROR   4
+#define KASA_METRIC_NOSPACE      5
+#define KASA_METRIC_RETRY        6
+#define KASA_METRIC_TIMEOUT      7
+#define KASA_METRIC_SILENT       8
+#define KASA_METRIC_UNCHANGED    9
+#define KASA_METRIC_DEFERRED    10
+#define KASA_METRIC_SUPERSEDED  11
+#define KASA_METRIC_OVERFLOW    12
+#define KASA_METRIC_COUNT       13
+
+void housekasa_metrics_increment (int counter);
+void housekasa_metrics_add (int counter, int value);
+
+const char *housekasa_metrics_export (char *buffer, int size);
+
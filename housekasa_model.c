@@ -0,0 +1,236 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housekasa_model.c - The capabilities and protocol variants of each model.
+ *
+ * SYNOPSYS:
+ *
+ * int housekasa_model_search (const char *model);
+ *
+ *    Return the index of the table entry matching the model name, as
+ *    reported in system.get_sysinfo.model (e.g. "KP400(US)"), using the
+ *    longest matching prefix. The match is not case sensitive. Return 0,
+ *    the generic entry, if the model is unknown or not provided.
+ *
+ *    This is meant to be called once per device, when its model becomes
+ *    known. The other functions then only index the table.
+ *
+ * const char *housekasa_model_name (int model);
+ * int housekasa_model_features (int model);
+ *
+ *    Return the model prefix, or the features of the model (a combination
+ *    of the KASA_MODEL_* flags).
+ *
+ * int housekasa_model_control (int model, char *buffer, int size,
+ *                              const char *parent,
+ *                              const char **children, int count,
+ *                              int state, int combined, const char *extra);
+ *
+ *    Format the request that turns the device (or the listed outlets of
+ *    the device) on (1) or off (0). The outlet ID used in the protocol is
+ *    the parent ID followed by the child ID. If combined is true, a
+ *    get_sysinfo request is included. The extra string, if not empty, is
+ *    appended as additional module requests (it must start with a comma).
+ *    Return the length of the request, or 0 if it does not fit.
+ *
+ * int housekasa_model_brightness (int model, char *buffer, int size,
+ *                                 int level, int combined);
+ *
+ *    Format the request that sets the brightness of a dimmer. Return
+ *    the length of the request, or 0 if this model is not a dimmer.
+ *
+ * int housekasa_model_switch (int model, char *buffer, int size, int state);
+ *
+ *    Format the request that turns a dimmer on (1) or off (0) through its
+ *    dimmer module, as the dimmer's own switch does. Return the length of
+ *    the request, or 0 if this model is not a dimmer. (The housekasa
+ *    service uses housekasa_model_control() for all models, since it also
+ *    needs the relay state from the combined get_sysinfo.)
+ *
+ * This module does not depend on any library, so that it can be used
+ * by the kasa command line tool as well.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "housekasa_model.h"
+
+typedef int housekasa_model_relay_encoder
+                (char *buffer, int size, const char *parent,
+                 const char **children, int count,
+                 int state, int combined, const char *extra);
+
+typedef int housekasa_model_level_encoder
+                (char *buffer, int size, int level, int combined);
+
+struct KasaModel {
+    const char *prefix;
+    int features;
+    housekasa_model_relay_encoder *control;
+    housekasa_model_level_encoder *brightness;
+};
+
+// The requests that are sent most often are prepared in advance:
+// indexed by combined, then by state.
+//
+static const char *KasaRelayTemplates[2][2] = {
+    {"{\"system\":{\"set_relay_state\":{\"state\":0}}}",
+     "{\"system\":{\"set_relay_state\":{\"state\":1}}}"},
+    {"{\"system\":{\"set_relay_state\":{\"state\":0},\"get_sysinfo\":{}}}",
+     "{\"system\":{\"set_relay_state\":{\"state\":1},\"get_sysinfo\":{}}}"}
+};
+
+static int housekasa_model_relay (char *buffer, int size, const char *parent,
+                                  const char **children, int count,
+                                  int state, int combined, const char *extra) {
+    int i;
+    int cursor;
+
+    state = state ? 1 : 0;
+    combined = combined ? 1 : 0;
+
+    if ((count <= 0) && ((!extra) || (!extra[0]))) {
+        cursor = strlen (KasaRelayTemplates[combined][state]);
+        if (cursor >= size) return 0;
+        memcpy (buffer, KasaRelayTemplates[combined][state], cursor+1);
+        return cursor;
+    }
+
+    cursor = 0;
+    if (count > 0) {
+        cursor = snprintf (buffer, size, "{\"context\":{\"child_ids\":[");
+        for (i = 0; i < count; ++i) {
+            if (cursor >= size) return 0;
+            cursor += snprintf (buffer+cursor, size-cursor, "%s\"%s%s\"",
+                                i?",":"", parent?parent:"", children[i]);
+        }
+        if (cursor >= size) return 0;
+        cursor += snprintf (buffer+cursor, size-cursor, "]},");
+    } else {
+        cursor = snprintf (buffer, size, "{");
+    }
+    if (cursor >= size) return 0;
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        "\"system\":{\"set_relay_state\":{\"state\":%d}%s}%s}",
+                        state, combined?",\"get_sysinfo\":{}":"",
+                        extra?extra:"");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+static int housekasa_model_dimmer (char *buffer, int size,
+                                   int level, int combined) {
+    int cursor =
+        snprintf (buffer, size,
+                  "{\"smartlife.iot.dimmer\":{\"set_brightness\":{\"brightness\":%d}}%s}",
+                  level, combined?",\"system\":{\"get_sysinfo\":{}}":"");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+static const char *KasaSwitchTemplates[2] = {
+    "{\"smartlife.iot.dimmer\":{\"set_switch_state\":{\"state\":0}}}",
+    "{\"smartlife.iot.dimmer\":{\"set_switch_state\":{\"state\":1}}}"
+};
+
+#define KASA_PLUG     (KASA_MODEL_COMBINED|KASA_MODEL_COUNTDOWN)
+#define KASA_STRIP    (KASA_PLUG|KASA_MODEL_CHILDREN)
+
+// The first entry is used for unknown models. Its features are the most
+// common ones: the device module learns at runtime if a model does not
+// support them. An unknown model is handled as a dimmer if it reports
+// a brightness.
+//
+static const struct KasaModel KasaModels[] = {
+    {"",      KASA_PLUG, housekasa_model_relay, housekasa_model_dimmer},
+    {"HS100", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS103", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS105", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS110", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS200", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS210", KASA_PLUG, housekasa_model_relay, 0},
+    {"HS220", KASA_PLUG|KASA_MODEL_DIMMER,
+              housekasa_model_relay, housekasa_model_dimmer},
+    {"HS300", KASA_STRIP, housekasa_model_relay, 0},
+    {"KP100", KASA_PLUG, housekasa_model_relay, 0},
+    {"KP115", KASA_PLUG, housekasa_model_relay, 0},
+    {"KP125", KASA_PLUG, housekasa_model_relay, 0},
+    {"KP200", KASA_STRIP, housekasa_model_relay, 0},
+    {"KP303", KASA_STRIP, housekasa_model_relay, 0},
+    {"KP400", KASA_STRIP, housekasa_model_relay, 0},
+    {"EP10",  KASA_PLUG, housekasa_model_relay, 0},
+    {"EP25",  KASA_PLUG, housekasa_model_relay, 0},
+    {"EP40",  KASA_STRIP, housekasa_model_relay, 0},
+    {"ES20M", KASA_PLUG|KASA_MODEL_DIMMER,
+              housekasa_model_relay, housekasa_model_dimmer},
+    {"KS220", KASA_PLUG|KASA_MODEL_DIMMER,
+              housekasa_model_relay, housekasa_model_dimmer},
+    {0, 0, 0, 0}
+};
+
+int housekasa_model_search (const char *model) {
+    int i;
+    int best = 0;
+    int length = 0;
+    if (!model) return 0;
+    for (i = 1; KasaModels[i].prefix; ++i) {
+        int l = strlen (KasaModels[i].prefix);
+        if (l <= length) continue;
+        if (strncasecmp (model, KasaModels[i].prefix, l)) continue;
+        best = i;
+        length = l;
+    }
+    return best;
+}
+
+const char *housekasa_model_name (int model) {
+    return KasaModels[model].prefix;
+}
+
+int housekasa_model_features (int model) {
+    return KasaModels[model].features;
+}
+
+int housekasa_model_control (int model, char *buffer, int size,
+                             const char *parent,
+                             const char **children, int count,
+                             int state, int combined, const char *extra) {
+    return KasaModels[model].control (buffer, size, parent, children, count,
+                                      state, combined, extra);
+}
+
+int housekasa_model_brightness (int model, char *buffer, int size,
+                                int level, int combined) {
+    if (!KasaModels[model].brightness) return 0;
+    return KasaModels[model].brightness (buffer, size, level, combined);
+}
+
+
+int housekasa_model_switch (int model, char *buffer, int size, int state) {
+    if (!(KasaModels[model].features & KASA_MODEL_DIMMER)) return 0;
+    const char *request = KasaSwitchTemplates[state?1:0];
+    int length = strlen (request);
+    if (length >= size) return 0;
+    memcpy (buffer, request, length+1);
+    return length;
+}
@@ -0,0 +1,43 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_model.h - The capabilities and protocol variants of each model.
+ *
+ */
+#define KASA_MODEL_CHILDREN   1 // Multiple outlets: a child ID is required.
+#define KASA_MODEL_DIMMER     2 // Has a smartlife.iot.dimmer module.
+#define KASA_MODEL_COMBINED   8 // Accepts get_sysinfo with a control.
+#define KASA_MODEL_COUNTDOWN 16 // Has a count_down module.
+
+int housekasa_model_search (const char *model);
+
+const char *housekasa_model_name (int model);
+int housekasa_model_features (int model);
+
+int housekasa_model_control (int model, char *buffer, int size,
+                             const char *parent,
+                             const char **children, int count,
+                             int state, int combined, const char *extra);
+
+int housekasa_model_brightness (int model, char *buffer, int size,
+                                int level, int combined);
+
+int housekasa_model_switch (int model, char *buffer, int size, int state);
+
@@ -0,0 +1,237 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_profile.c - Measure the cost of the background subsystems.
+ *
+ * SYNOPSYS:
+ *
+ * void housekasa_profile_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module at startup. The -kasa-slow-tick=N option
+ *    defines the duration (in milliseconds) above which a tick is traced
+ *    as slow. The default is 100 milliseconds.
+ *
+ * int housekasa_profile_declare (const char *name);
+ *
+ *    Declare a new stage to be measured. Return the stage identifier.
+ *
+ * void housekasa_profile_start (void);
+ * void housekasa_profile_stage (int stage);
+ * void housekasa_profile_end   (void);
+ *
+ *    Measure one tick. The time elapsed since the start of the tick, or
+ *    since the end of the previous stage, is accounted to the stage.
+ *    Statistics are calculated over a window of ticks.
+ *
+ * const char *housekasa_profile_export (char *buffer, int size);
+ *
+ *    Format the statistics (min, average, max and 99th percentile of each
+ *    stage) for the latest complete window and for the current one,
+ *    as a JSON document. Return an error message, or a null pointer
+ *    on success.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "houselog.h"
+
+#include "housekasa_profile.h"
+
+#define KASAPROFILEWINDOW 100 // Ticks.
+#define KASAPROFILEMAX    16  // Stages.
+
+struct ProfileStatistics {
+    int count;
+    int min;
+    int avg;
+    int max;
+    int p99;
+};
+
+struct ProfileStage {
+    const char *name;
+    int current; // Duration for the current tick.
+    int samples[KASAPROFILEWINDOW];
+    struct ProfileStatistics latest;
+};
+
+// Stage 0 is the whole tick.
+static struct ProfileStage ProfileStages[KASAPROFILEMAX] = {{"tick"}};
+static int ProfileStagesCount = 1;
+
+static int ProfileTicks = 0;
+static time_t ProfileWindowStart = 0;
+static time_t ProfileLatestStart = 0;
+static int ProfileSlowTicks = 0;
+static int ProfileSlowThreshold = 100000; // Microseconds.
+
+static long long ProfileTickStart = 0;
+static long long ProfileLastMark = 0;
+
+static long long housekasa_profile_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000);
+}
+
+void housekasa_profile_initialize (int argc, const char **argv) {
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-kasa-slow-tick=", argv[i], &value))
+            ProfileSlowThreshold = atoi(value) * 1000;
+    }
+}
+
+int housekasa_profile_declare (const char *name) {
+    if (ProfileStagesCount >= KASAPROFILEMAX) return 0;
+    ProfileStages[ProfileStagesCount].name = name;
+    return ProfileStagesCount++;
+}
+
+void housekasa_profile_start (void) {
+    ProfileTickStart = ProfileLastMark = housekasa_profile_clock();
+    if (!ProfileWindowStart) ProfileWindowStart = time(0);
+}
+
+void housekasa_profile_stage (int stage) {
+    long long now = housekasa_profile_clock();
+    if (stage > 0 && stage < ProfileStagesCount)
+        ProfileStages[stage].current += (int)(now - ProfileLastMark);
+    ProfileLastMark = now;
+}
+
+static int housekasa_profile_compare (const void *a, const void *b) {
+    return *((const int *)a) - *((const int *)b);
+}
+
+static void housekasa_profile_calculate (const int *samples, int count,
+                                         struct ProfileStatistics *stats) {
+    int i;
+    int sorted[KASAPROFILEWINDOW];
+    long long sum = 0;
+
+    memset (stats, 0, sizeof(*stats));
+    if (count <= 0) return;
+
+    memcpy (sorted, samples, count * sizeof(int));
+    qsort (sorted, count, sizeof(int), housekasa_profile_compare);
+    for (i = 0; i < count; ++i) sum += sorted[i];
+
+    stats->count = count;
+    stats->min = sorted[0];
+    stats->max = sorted[count-1];
+    stats->avg = (int)(sum / count);
+    stats->p99 = sorted[((count * 99) + 99) / 100 - 1]; // Nearest rank.
+}
+
+void housekasa_profile_end (void) {
+
+    int i;
+    ProfileStages[0].current =
+        (int)(housekasa_profile_clock() - ProfileTickStart);
+
+    if (ProfileStages[0].current > ProfileSlowThreshold) {
+        char detail[512];
+        int cursor = 0;
+        detail[0] = 0;
+        for (i = 1; i < ProfileStagesCount; ++i) {
+            if (ProfileStages[i].current < 1000) continue;
+            cursor += snprintf (detail+cursor, sizeof(detail)-cursor,
+                                ", %s %d ms", ProfileStages[i].name,
+                                ProfileStages[i].current / 1000);
+            if (cursor >= sizeof(detail)) break;
+        }
+        houselog_trace (HOUSE_WARNING, "PROFILE", "slow tick: %d ms%s",
+                        ProfileStages[0].current / 1000, detail);
+        ProfileSlowTicks += 1;
+    }
+
+    for (i = 0; i < ProfileStagesCount; ++i) {
+        ProfileStages[i].samples[ProfileTicks] = ProfileStages[i].current;
+        ProfileStages[i].current = 0;
+    }
+    if (++ProfileTicks < KASAPROFILEWINDOW) return;
+
+    for (i = 0; i < ProfileStagesCount; ++i) {
+        housekasa_profile_calculate (ProfileStages[i].samples, ProfileTicks,
+                                     &(ProfileStages[i].latest));
+    }
+    ProfileLatestStart = ProfileWindowStart;
+    ProfileWindowStart = time(0);
+    ProfileTicks = 0;
+}
+
+static void housekasa_profile_add (ParserContext context, int parent,
+                                   const char *name,
+                                   const struct ProfileStatistics *stats) {
+    int item = echttp_json_add_object (context, parent, name);
+    echttp_json_add_integer (context, item, "count", stats->count);
+    echttp_json_add_integer (context, item, "min", stats->min);
+    echttp_json_add_integer (context, item, "avg", stats->avg);
+    echttp_json_add_integer (context, item, "max", stats->max);
+    echttp_json_add_integer (context, item, "p99", stats->p99);
+}
+
+const char *housekasa_profile_export (char *buffer, int size) {
+
+    ParserToken token[256];
+    char pool[16384];
+    int i;
+
+    ParserContext context = echttp_json_start (token, 256, pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
+    int top = echttp_json_add_object (context, root, "profile");
+    echttp_json_add_string (context, top, "unit", "us");
+    echttp_json_add_integer (context, top, "threshold", ProfileSlowThreshold);
+    echttp_json_add_integer (context, top, "slow", ProfileSlowTicks);
+
+    if (ProfileLatestStart) {
+        int latest = echttp_json_add_object (context, top, "latest");
+        echttp_json_add_integer (context, latest, "start", (long)ProfileLatestStart);
+        int stages = echttp_json_add_object (context, latest, "stages");
+        for (i = 0; i < ProfileStagesCount; ++i) {
+            housekasa_profile_add (context, stages,
+                                   ProfileStages[i].name,
+                                   &(ProfileStages[i].latest));
+        }
+    }
+
+    int current = echttp_json_add_object (context, top, "current");
+    echttp_json_add_integer (context, current, "start", (long)ProfileWindowStart);
+    int stages = echttp_json_add_object (context, current, "stages");
+    for (i = 0; i < ProfileStagesCount; ++i) {
+        struct ProfileStatistics stats;
+        housekasa_profile_calculate
+            (ProfileStages[i].samples, ProfileTicks, &stats);
+        housekasa_profile_add (context, stages, ProfileStages[i].name, &stats);
+    }
+
+    return echttp_json_export (context, buffer, size);
+}
+
@@ -0,0 +1,33 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_profile.h - Measure the cost of the background subsystems.
+ *
+ */
+void housekasa_profile_initialize (int argc, const char **argv);
+
+int  housekasa_profile_declare (const char *name);
+
+void housekasa_profile_start (void);
+void housekasa_profile_stage (int stage);
+void housekasa_profile_end   (void);
+
+const char *housekasa_profile_export (char *buffer, int size);
+
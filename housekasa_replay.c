@@ -0,0 +1,263 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housekasa_replay.c - Capture and replay the datagrams received.
+ *
+ * SYNOPSYS:
+ *
+ * void housekasa_replay_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module at startup. The -kasa-capture=FILE option
+ *    records every datagram received to the specified file. The
+ *    -kasa-replay=FILE option selects the replay mode: the program then
+ *    processes the datagrams from the file instead of the network, as fast
+ *    as possible, or at the original pace if -kasa-replay-realtime is
+ *    also present. Nothing is sent to the devices in replay mode.
+ *
+ * int housekasa_replay_active (void);
+ *
+ *    Return true if the replay mode was selected.
+ *
+ * void housekasa_replay_capture (const char *data, int length,
+ *                                const struct sockaddr_in *addr,
+ *                                int ifindex);
+ *
+ *    Record one datagram, as received (i.e. encrypted). This may be called
+ *    from the I/O thread.
+ *
+ * void housekasa_replay_stage (int stage);
+ *
+ *    Account the time elapsed since the previous stage to the specified
+ *    stage. This does nothing if not in replay mode.
+ *
+ * int housekasa_replay_run (void);
+ *
+ *    Feed all the datagrams from the replay file to the I/O module, as if
+ *    they had been received, then print the throughput and the time spent
+ *    in each stage. Return the process exit status.
+ *
+ * The capture file starts with a magic string, followed by one record
+ * for each datagram: a fixed size header followed by the raw datagram
+ * data. The timestamps come from the monotonic clock, in microseconds.
+ * This format is not meant to be portable.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "housekasa_io.h"
+#include "housekasa_replay.h"
+
+#define KASA_CAPTURE_MAGIC "KASACAP1"
+
+struct CaptureRecord {
+    int64_t timestamp; // Microseconds.
+    uint32_t address;  // Network byte order.
+    uint16_t port;     // Network byte order.
+    uint16_t ifindex;
+    uint32_t length;
+};
+
+static int ReplayCaptureFd = -1;
+
+static const char *ReplayFile = 0;
+static int ReplayRealTime = 0;
+
+static const char *ReplayStageNames[KASA_REPLAY_STAGES] = {
+    "decrypt", "filter", "parse", "update"
+};
+static long long ReplayStageTime[KASA_REPLAY_STAGES];
+static long long ReplayMark = 0;
+
+static long long housekasa_replay_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000);
+}
+
+void housekasa_replay_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *capture = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-kasa-capture=", argv[i], &capture);
+        echttp_option_match ("-kasa-replay=", argv[i], &ReplayFile);
+        if (echttp_option_present ("-kasa-replay-realtime", argv[i]))
+            ReplayRealTime = 1;
+    }
+
+    if (capture && (!ReplayFile)) {
+        ReplayCaptureFd = open (capture, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (ReplayCaptureFd < 0) {
+            houselog_trace (HOUSE_FAILURE, capture,
+                            "cannot open: %s", strerror(errno));
+            return;
+        }
+        if (write (ReplayCaptureFd, KASA_CAPTURE_MAGIC, 8) != 8) {
+            close (ReplayCaptureFd);
+            ReplayCaptureFd = -1;
+            return;
+        }
+        houselog_trace (HOUSE_INFO, capture, "capturing all datagrams");
+    }
+}
+
+int housekasa_replay_active (void) {
+    return ReplayFile != 0;
+}
+
+void housekasa_replay_capture (const char *data, int length,
+                               const struct sockaddr_in *addr, int ifindex) {
+
+    if (ReplayCaptureFd < 0) return;
+
+    struct CaptureRecord record;
+    struct iovec io[2];
+
+    record.timestamp = housekasa_replay_clock();
+    record.address = addr->sin_addr.s_addr;
+    record.port = addr->sin_port;
+    record.ifindex = ifindex;
+    record.length = length;
+
+    io[0].iov_base = &record;
+    io[0].iov_len = sizeof(record);
+    io[1].iov_base = (void *)data;
+    io[1].iov_len = length;
+
+    if (writev (ReplayCaptureFd, io, 2) != sizeof(record) + length) {
+        // Do not log from here (this may be the I/O thread): just stop.
+        close (ReplayCaptureFd);
+        ReplayCaptureFd = -1;
+    }
+}
+
+void housekasa_replay_stage (int stage) {
+
+    if (!ReplayFile) return;
+
+    long long now = housekasa_replay_clock();
+    if (stage >= 0 && stage < KASA_REPLAY_STAGES)
+        ReplayStageTime[stage] += now - ReplayMark;
+    ReplayMark = now;
+}
+
+int housekasa_replay_run (void) {
+
+    static char buffer[65537];
+    struct stat info;
+    int i;
+    long count = 0;
+
+    int fd = open (ReplayFile, O_RDONLY);
+    if (fd < 0) {
+        fprintf (stderr, "%s: %s\n", ReplayFile, strerror(errno));
+        return 1;
+    }
+    if (fstat (fd, &info) < 0 || info.st_size < 8) {
+        fprintf (stderr, "%s: not a capture file\n", ReplayFile);
+        close (fd);
+        return 1;
+    }
+    const char *map = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "%s: %s\n", ReplayFile, strerror(errno));
+        return 1;
+    }
+    if (memcmp (map, KASA_CAPTURE_MAGIC, 8)) {
+        fprintf (stderr, "%s: not a capture file\n", ReplayFile);
+        munmap ((void *)map, info.st_size);
+        return 1;
+    }
+
+    const char *cursor = map + 8;
+    const char *end = map + info.st_size;
+    long long first = -1;
+    long long start = housekasa_replay_clock();
+
+    while (cursor + sizeof(struct CaptureRecord) <= end) {
+
+        struct CaptureRecord record;
+        memcpy (&record, cursor, sizeof(record));
+        cursor += sizeof(record);
+        if (cursor + record.length > end) break; // Truncated capture.
+        if (record.length >= sizeof(buffer)) {
+            cursor += record.length;
+            continue;
+        }
+
+        if (ReplayRealTime) {
+            if (first < 0) first = record.timestamp;
+            long long delay =
+                (start + (record.timestamp - first)) - housekasa_replay_clock();
+            if (delay > 0) {
+                struct timespec pause;
+                pause.tv_sec = delay / 1000000;
+                pause.tv_nsec = (delay % 1000000) * 1000;
+                nanosleep (&pause, 0);
+            }
+        }
+
+        struct sockaddr_in addr;
+        memset (&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = record.address;
+        addr.sin_port = record.port;
+
+        memcpy (buffer, cursor, record.length);
+        cursor += record.length;
+
+        ReplayMark = housekasa_replay_clock();
+        housekasa_io_replay (buffer, record.length, &addr, record.ifindex);
+        housekasa_replay_stage (KASA_REPLAY_UPDATE);
+        count += 1;
+    }
+    munmap ((void *)map, info.st_size);
+
+    long long elapsed = housekasa_replay_clock() - start;
+    printf ("replayed %ld datagrams in %lld ms: %.0f datagrams/s\n",
+            count, elapsed / 1000,
+            elapsed ? (count * 1000000.0) / elapsed : 0.0);
+    for (i = 0; i < KASA_REPLAY_STAGES; ++i) {
+        printf ("%-8s %10lld us total, %8.2f us per datagram\n",
+                ReplayStageNames[i], ReplayStageTime[i],
+                count ? (double)(ReplayStageTime[i]) / count : 0.0);
+    }
+    return 0;
+}
+
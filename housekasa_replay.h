@@ -0,0 +1,42 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa devices.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_replay.h - Capture and replay the datagrams received.
+ *
+ */
+struct sockaddr_in;
+
+#define KASA_REPLAY_DECRYPT 0
+#define KASA_REPLAY_FILTER  1 // Fingerprint of unchanged status replies.
+#define KASA_REPLAY_PARSE   2
+#define KASA_REPLAY_UPDATE  3
+#define KASA_REPLAY_STAGES  4
+
+void housekasa_replay_initialize (int argc, const char **argv);
+
+int  housekasa_replay_active (void);
+
+void housekasa_replay_capture (const char *data, int length,
+                               const struct sockaddr_in *addr, int ifindex);
+
+void housekasa_replay_stage (int stage);
+
+int  housekasa_replay_run (void);
+
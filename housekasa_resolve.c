@@ -0,0 +1,213 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housekasa_resolve.c - Resolve host names without blocking.
+ *
+ * SYNOPSYS:
+ *
+ * void housekasa_resolve_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module at startup. The -kasa-dns-ttl=N option defines
+ *    how long (in seconds) a resolved address is kept before it is
+ *    resolved again. The default is 300 seconds.
+ *
+ * int housekasa_resolve (const char *name, struct in_addr *addr);
+ *
+ *    Return the address of the specified host. A numeric address is
+ *    decoded immediately. Otherwise the address comes from the cache:
+ *    if the name is not in the cache, or its address expired, a lookup
+ *    is started in the background. Return 1 if an address is available
+ *    (possibly an expired one, while it is being refreshed), 0 otherwise.
+ *
+ * int housekasa_resolve_background (void);
+ *
+ *    Collect the results of the lookups that completed, and refresh
+ *    the addresses that expired. Return the number of lookups that
+ *    completed: the caller should then call housekasa_resolve() again
+ *    for its names, which gets the new addresses and also tells that
+ *    these names are still in use. A name that was not looked up since
+ *    its last refresh is dropped from the cache when it expires again.
+ *    This must be called periodically.
+ *
+ * The lookups use getaddrinfo_a(), so that a slow or unreachable DNS
+ * server never blocks the echttp loop.
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "housekasa_timer.h"
+#include "housekasa_resolve.h"
+
+#define KASA_RESOLVE_RETRY 30000 // ms, after a failed lookup.
+
+struct ResolveEntry {
+    char *name;
+    struct in_addr addr; // 0 if never resolved.
+    long long expires;
+    int pending;
+    int failed;
+    int used;    // Looked up since the last refresh.
+    struct addrinfo hints;
+    struct gaicb request;
+};
+
+// The entries are allocated individually: a pending request must not
+// move in memory.
+//
+static struct ResolveEntry **ResolveCache = 0;
+static int ResolveCount = 0;
+static int ResolveSpace = 0;
+
+static int ResolveTtl = 300000; // ms
+
+void housekasa_resolve_initialize (int argc, const char **argv) {
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-kasa-dns-ttl=", argv[i], &value))
+            ResolveTtl = atoi(value) * 1000;
+    }
+}
+
+static void housekasa_resolve_start (struct ResolveEntry *entry,
+                                     long long now) {
+
+    struct gaicb *list[1];
+
+    memset (&(entry->request), 0, sizeof(entry->request));
+    memset (&(entry->hints), 0, sizeof(entry->hints));
+    entry->hints.ai_family = AF_INET;
+    entry->hints.ai_socktype = SOCK_DGRAM;
+    entry->request.ar_name = entry->name;
+    entry->request.ar_request = &(entry->hints);
+
+    list[0] = &(entry->request);
+    int status = getaddrinfo_a (GAI_NOWAIT, list, 1, 0);
+    if (status) {
+        houselog_trace (HOUSE_FAILURE, entry->name,
+                        "cannot resolve: %s", gai_strerror(status));
+        entry->expires = now + KASA_RESOLVE_RETRY;
+        return;
+    }
+    entry->pending = 1;
+}
+
+static void housekasa_resolve_drop (int index) {
+    struct ResolveEntry *entry = ResolveCache[index];
+    if (echttp_isdebug()) fprintf (stderr, "drop host %s\n", entry->name);
+    free (entry->name);
+    free (entry);
+    ResolveCache[index] = ResolveCache[--ResolveCount];
+}
+
+static struct ResolveEntry *housekasa_resolve_search (const char *name) {
+
+    int i;
+    for (i = 0; i < ResolveCount; ++i) {
+        if (!strcmp (name, ResolveCache[i]->name)) return ResolveCache[i];
+    }
+    if (ResolveCount >= ResolveSpace) {
+        ResolveSpace += 16;
+        ResolveCache = realloc (ResolveCache, ResolveSpace * sizeof(*ResolveCache));
+    }
+    struct ResolveEntry *entry = calloc (1, sizeof(struct ResolveEntry));
+    entry->name = strdup (name);
+    ResolveCache[ResolveCount++] = entry;
+    return entry;
+}
+
+int housekasa_resolve (const char *name, struct in_addr *addr) {
+
+    if (inet_aton (name, addr)) return 1;
+
+    struct ResolveEntry *entry = housekasa_resolve_search (name);
+    long long now = housekasa_timer_now();
+
+    if ((!entry->pending) && (now >= entry->expires))
+        housekasa_resolve_start (entry, now);
+    entry->used = 1;
+
+    if (!entry->addr.s_addr) return 0;
+    *addr = entry->addr;
+    return 1;
+}
+
+int housekasa_resolve_background (void) {
+
+    int i;
+    int completed = 0;
+    long long now = housekasa_timer_now();
+
+    for (i = 0; i < ResolveCount; ++i) {
+        struct ResolveEntry *entry = ResolveCache[i];
+
+        if (!entry->pending) {
+            if (now < entry->expires) continue;
+            if (!entry->used) {
+                // Nobody asked for this name since it was last refreshed.
+                housekasa_resolve_drop (i--);
+                continue;
+            }
+            housekasa_resolve_start (entry, now);
+            if (entry->pending) entry->used = 0;
+            continue;
+        }
+        int status = gai_error (&(entry->request));
+        if (status == EAI_INPROGRESS) continue;
+        entry->pending = 0;
+        completed += 1;
+
+        struct addrinfo *resolved = entry->request.ar_result;
+        if (status || !resolved) {
+            // Keep the previous address, if any: it might still be valid.
+            if (!entry->failed)
+                houselog_trace (HOUSE_WARNING, entry->name,
+                                "cannot resolve: %s", gai_strerror(status));
+            entry->failed = 1;
+            entry->expires = now + KASA_RESOLVE_RETRY;
+            if (resolved) freeaddrinfo (resolved);
+            continue;
+        }
+        struct in_addr addr =
+            ((struct sockaddr_in *)(resolved->ai_addr))->sin_addr;
+        freeaddrinfo (resolved);
+
+        entry->failed = 0;
+        entry->expires = now + ResolveTtl;
+        entry->addr = addr;
+    }
+    return completed;
+}
+
@@ -0,0 +1,225 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housekasa_shard.c - Share the devices between several housekasa instances.
+ *
+ * SYNOPSYS:
+ *
+ * void housekasa_shard_initialize (int argc, const char **argv, int port);
+ *
+ *    Initialize this module at startup. Sharding is enabled by the
+ *    -kasa-shard option. The instances find each other through
+ *    the "kasa" service declared to the House portal.
+ *
+ * int housekasa_shard_enabled (void);
+ *
+ *    Return true if sharding is enabled.
+ *
+ * int housekasa_shard_owned (const char *id);
+ *
+ *    Return true if the device with the specified ID belongs to this
+ *    instance. Always true if sharding is not enabled.
+ *
+ * int housekasa_shard_background (time_t now);
+ *
+ *    Refresh the list of instances when the discovery detected a change.
+ *    Return true if the list of instances changed, i.e. the devices
+ *    were rebalanced.
+ *
+ * Each device is assigned to an instance using rendezvous hashing: every
+ * instance computes a hash of each instance's URL combined with the device
+ * ID, and the instance with the highest hash owns the device. This only
+ * moves the devices of an instance that leaves, or the share of the
+ * instance that joins, and all instances agree without talking to each
+ * other as long as they discovered the same list of instances. The URLs
+ * are normalized to the lowercase short host name, so that the URL built
+ * locally matches the URL advertised by the portal for this instance.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+#include "housediscover.h"
+
+#include "housekasa_shard.h"
+
+#define KASA_SHARD_MAX 32
+
+static int ShardEnabled = 0;
+
+static char *ShardSelf = 0;
+static char *ShardMembers[KASA_SHARD_MAX];
+static int ShardCount = 0;
+
+static time_t ShardLatestCheck = 0;
+
+// All instances must hash the same string for a given instance: the URL
+// built locally from gethostname() may differ from the URL advertised by
+// the portal in case or domain. Only keep the lowercase short host name,
+// unless this is a numeric address.
+//
+static void housekasa_shard_normalize (const char *url,
+                                       char *buffer, int size) {
+    int cursor = 0;
+    int numeric = 1;
+    const char *host = strstr (url, "://");
+    host = host ? host + 3 : url;
+
+    while ((url < host) && (cursor < size - 1)) buffer[cursor++] = *(url++);
+
+    const char *end = host + strcspn (host, ":/");
+    const char *p;
+    for (p = host; p < end; ++p) {
+        if ((*p != '.') && ((*p < '0') || (*p > '9'))) numeric = 0;
+    }
+    if (!numeric) {
+        const char *dot = memchr (host, '.', end - host);
+        if (dot) end = dot;
+    }
+    for (p = host; (p < end) && (cursor < size - 1); ++p)
+        buffer[cursor++] = tolower(*p);
+
+    p = host + strcspn (host, ":/"); // Port and path, as is.
+    while (*p && (cursor < size - 1)) buffer[cursor++] = *(p++);
+    buffer[cursor] = 0;
+}
+
+void housekasa_shard_initialize (int argc, const char **argv, int port) {
+
+    int i;
+    char url[512];
+    char host[256];
+    char normalized[512];
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-kasa-shard", argv[i])) ShardEnabled = 1;
+    }
+    if (!ShardEnabled) return;
+
+    gethostname (host, sizeof(host));
+    snprintf (url, sizeof(url), "http://%s:%d/kasa", host, port);
+    housekasa_shard_normalize (url, normalized, sizeof(normalized));
+    ShardSelf = strdup (normalized);
+    ShardMembers[0] = ShardSelf;
+    ShardCount = 1;
+    houselog_trace (HOUSE_INFO, "SHARD", "enabled as %s", ShardSelf);
+}
+
+int housekasa_shard_enabled (void) {
+    return ShardEnabled;
+}
+
+static unsigned long long housekasa_shard_hash (const char *member,
+                                                const char *id) {
+    unsigned long long hash = 14695981039346656037ULL; // FNV-1a.
+    const char *p;
+    for (p = member; *p; ++p) {
+        hash ^= (unsigned char)(*p);
+        hash *= 1099511628211ULL;
+    }
+    hash ^= '/';
+    hash *= 1099511628211ULL;
+    for (p = id; *p; ++p) {
+        hash ^= (unsigned char)(*p);
+        hash *= 1099511628211ULL;
+    }
+    // Final mix, so that similar IDs are spread evenly.
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+int housekasa_shard_owned (const char *id) {
+
+    int i;
+    int owner = 0;
+    unsigned long long best = 0;
+
+    if ((!ShardEnabled) || (ShardCount <= 1)) return 1;
+    if (!id) return 1;
+
+    for (i = 0; i < ShardCount; ++i) {
+        unsigned long long weight = housekasa_shard_hash (ShardMembers[i], id);
+        if (weight > best) {
+            best = weight;
+            owner = i;
+        }
+    }
+    return ShardMembers[owner] == ShardSelf;
+}
+
+static void housekasa_shard_discovered (const char *service,
+                                        void *context, const char *url) {
+    int *count = (int *)context;
+    int i;
+    char normalized[512];
+    housekasa_shard_normalize (url, normalized, sizeof(normalized));
+    if (!strcmp (normalized, ShardSelf)) return; // Already listed first.
+    if (*count >= KASA_SHARD_MAX) return;
+    for (i = 1; i < *count; ++i) {
+        if (!strcmp (normalized, ShardMembers[i])) return; // Duplicate.
+    }
+    ShardMembers[(*count)++] = strdup(normalized);
+}
+
+static int housekasa_shard_compare (const void *a, const void *b) {
+    return strcmp (*((const char **)a), *((const char **)b));
+}
+
+int housekasa_shard_background (time_t now) {
+
+    int i;
+    char *previous[KASA_SHARD_MAX];
+    int previouscount = ShardCount;
+
+    if (!ShardEnabled) return 0;
+    if (!housediscover_changed ("kasa", ShardLatestCheck)) return 0;
+    ShardLatestCheck = now;
+
+    memcpy (previous, ShardMembers, sizeof(previous));
+
+    int count = 1;
+    housediscovered ("kasa", &count, housekasa_shard_discovered);
+    ShardCount = count;
+
+    // Keep the others sorted, to make the comparison easy.
+    qsort (ShardMembers+1, ShardCount-1, sizeof(char *), housekasa_shard_compare);
+
+    int changed = (ShardCount != previouscount);
+    for (i = 1; (!changed) && (i < ShardCount); ++i) {
+        if (strcmp (ShardMembers[i], previous[i])) changed = 1;
+    }
+    for (i = 1; i < previouscount; ++i) free (previous[i]);
+
+    if (changed)
+        houselog_event ("SHARD", ShardSelf, "REBALANCED",
+                        "%d INSTANCES", ShardCount);
+    return changed;
+}
+
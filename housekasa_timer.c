@@ -0,0 +1,172 @@
+/* HouseKasa - A simple home web server for control of TP-Link Kasa Devices
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housekasa_timer.c - A millisecond precision deadline scheduler.
+ *
+ * SYNOPSYS:
+ *
+ * const char *housekasa_timer_initialize (void);
+ *
+ *    Create the timer and register it with the echttp loop.
+ *
+ * long long housekasa_timer_now (void);
+ *
+ *    Return the current time from the monotonic clock, in milliseconds.
+ *    This clock is not affected by wall clock adjustments (NTP, etc.).
+ *
+ * void housekasa_timer_schedule (long long deadline,
+ *                                housekasa_timer_handler *handler,
+ *                                int context);
+ *
+ *    Call the handler, with the provided context, once the monotonic
+ *    clock reaches the deadline.
+ *
+ *    There is no cancel: the handler must check if there is still something
+ *    to do when it is called. This keeps the scheduler simple, and the cost
+ *    of a stale entry is one spurious call.
+ *
+ * The deadlines are kept in a min-heap. A single timerfd is armed for the
+ * earliest deadline, and disarmed when nothing is due, so that the process
+ * is not woken up for nothing.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/timerfd.h>
+
+#include "echttp.h"
+
+#include "housekasa_timer.h"
+
+struct TimerEntry {
+    long long deadline;
+    housekasa_timer_handler *handler;
+    int context;
+};
+
+static struct TimerEntry *TimerHeap = 0;
+static int TimerCount = 0;
+static int TimerSpace = 0;
+
+static int TimerFd = -1;
+static long long TimerArmed = 0;
+
+long long housekasa_timer_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000LL) + (now.tv_nsec / 1000000);
+}
+
+static void housekasa_timer_arm (void) {
+
+    struct itimerspec timer;
+    long long next = TimerCount ? TimerHeap[0].deadline : 0;
+
+    if (TimerFd < 0) return; // Not yet initialized.
+    if (next == TimerArmed) return;
+
+    memset (&timer, 0, sizeof(timer)); // A zero value disarms the timer.
+    if (next) {
+        timer.it_value.tv_sec = next / 1000;
+        timer.it_value.tv_nsec = (next % 1000) * 1000000;
+    }
+    timerfd_settime (TimerFd, TFD_TIMER_ABSTIME, &timer, 0);
+    TimerArmed = next;
+}
+
+static void housekasa_timer_swap (int a, int b) {
+    struct TimerEntry tmp = TimerHeap[a];
+    TimerHeap[a] = TimerHeap[b];
+    TimerHeap[b] = tmp;
+}
+
+void housekasa_timer_schedule (long long deadline,
+                               housekasa_timer_handler *handler, int context) {
+
+    if (TimerCount >= TimerSpace) {
+        TimerSpace += 64;
+        TimerHeap = realloc (TimerHeap, TimerSpace * sizeof(struct TimerEntry));
+    }
+    int i = TimerCount++;
+    TimerHeap[i].deadline = deadline;
+    TimerHeap[i].handler = handler;
+    TimerHeap[i].context = context;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (TimerHeap[parent].deadline <= TimerHeap[i].deadline) break;
+        housekasa_timer_swap (i, parent);
+        i = parent;
+    }
+    housekasa_timer_arm ();
+}
+
+static void housekasa_timer_pop (void) {
+
+    int i = 0;
+
+    TimerHeap[0] = TimerHeap[--TimerCount];
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < TimerCount &&
+            TimerHeap[left].deadline < TimerHeap[smallest].deadline)
+            smallest = left;
+        if (right < TimerCount &&
+            TimerHeap[right].deadline < TimerHeap[smallest].deadline)
+            smallest = right;
+        if (smallest == i) break;
+        housekasa_timer_swap (i, smallest);
+        i = smallest;
+    }
+}
+
+static void housekasa_timer_fire (int fd, int mode) {
+
+    uint64_t expired;
+    if (read (fd, &expired, sizeof(expired)) < 0) {
+        // Nothing to do: the deadlines are checked anyway.
+    }
+    TimerArmed = 0; // The timer is now disarmed.
+
+    long long now = housekasa_timer_now();
+
+    while (TimerCount > 0 && TimerHeap[0].deadline <= now) {
+        struct TimerEntry entry = TimerHeap[0];
+        housekasa_timer_pop ();
+        entry.handler (entry.context); // This may schedule more.
+    }
+    housekasa_timer_arm ();
+}
+
+const char *housekasa_timer_initialize (void) {
+
+    TimerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (TimerFd < 0) return "cannot create the timer";
+    echttp_listen (TimerFd, 1, housekasa_timer_fire, 0);
+    housekasa_timer_arm ();
+    return 0;
+}
+
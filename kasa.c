@@ -27,6 +27,8 @@
  * kasa <host> alias <name>
  * kasa <host> on [<model> [<outlet>]]
  * kasa <host> off [<model> [<outlet>]]
+ * kasa --scan <cidr> [--rate <n>] [--timeout <ms>]
+ * kasa <host> --bench <n> [--rate <r>] [--toggle] [--timeout <ms>]
  *
  * Supported commands are: 
  *    alias: change the alias name configured in the device.
@@ -41,12 +43,30 @@
  *
  * In both cases the output is the raw message from the device. No formatting.
  *
- * The supported models are:
+ * The --scan option sends an unicast status request to every address in
+ * the specified network (for example 192.168.1.0/24), at a pace of n
+ * requests per second (default: 100). This is for networks where
+ * broadcasts are filtered. The program exits once all addresses answered,
+ * or after the timeout (in milliseconds, default: 2000) following the last
+ * request. Each response is printed as one JSON line.
+ *
+ * The --bench option sends n status requests (or on/off commands, if
+ * --toggle is used) to the specified device, and reports the loss rate
+ * and the distribution of the round trip time. The Kasa protocol has no
+ * request identifier, so only one request is outstanding at a time: the
+ * next request is sent once the response was received, or after the
+ * timeout (in milliseconds, default: 2000), in which case the request is
+ * counted as lost. The requests are spaced to at most r per second
+ * (default: 10). This measures how fast a device responds, not how many
+ * concurrent requests it can take.
+ *
+ * The model names and capabilities come from the table shared with
+ * housekasa (see housekasa_model.c), for example:
  *    kp400 (dual outlet: outlet ID is required)
- *    hs220 (single outlet: outlet ID ignored)
+ *    hs220 (single outlet dimmer: outlet ID ignored, uses set_switch_state)
  *
- * If the model is not specified, the program uses the most commonly supported
- * variant of the protocol. It might not always work.
+ * If the model is not specified or not known, the program uses the most
+ * commonly supported variant of the protocol. It might not always work.
  */
 
 #include <time.h>
@@ -59,12 +79,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#include "housekasa_model.h"
+
+#define KASAMAXDATA 65536 // The maximum size of an UDP payload.
+
 static int KasaPort = 9999;
 static int KasaSocket = -1;
 static struct sockaddr_in KasaAddress;
+static int KasaQuiet = 0;
 
 static void kasa_socket (void) {
 
@@ -83,12 +109,24 @@ static void kasa_socket (void) {
         printf ("cannot broadcast: %s\n", strerror(errno));
         exit(1);
     }
-    printf ("UDP socket is ready.\n");
+    if (!KasaQuiet) printf ("UDP socket is ready.\n");
 }
 
-static void kasa_send (const char *data) {
+static long long kasa_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000LL) + (now.tv_nsec / 1000000);
+}
 
-    char encoded[1024];
+static long long kasa_now_us (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000);
+}
+
+static int kasa_send_to (const struct sockaddr_in *addr, const char *data) {
+
+    static char encoded[KASAMAXDATA];
     int i;
     char key = 0xab;
     int length = strlen(data);
@@ -101,17 +139,20 @@ static void kasa_send (const char *data) {
         key = encoded[i] = key ^ data[i];
     }
 
+    return sendto (KasaSocket, encoded, length, 0,
+                   (struct sockaddr *)addr, sizeof(struct sockaddr_in));
+}
+
+static void kasa_send (const char *data) {
+
     printf ("Sending %s\n", data);
-    int sent = sendto (KasaSocket, encoded, length, 0,
-                       (struct sockaddr *)(&KasaAddress),
-                       sizeof(struct sockaddr_in));
-    if (sent < 0) {
+    if (kasa_send_to (&KasaAddress, data) < 0) {
         printf ("** sendto() error: %s\n", strerror(errno));
         exit(1);
     }
 }
 
-static int kasa_wait (void) {
+static int kasa_wait (int milliseconds) {
 
     fd_set receive;
     struct timeval timeout;
@@ -119,45 +160,166 @@ static int kasa_wait (void) {
     FD_ZERO(&receive);
     FD_SET(KasaSocket, &receive);
 
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
 
     return select (KasaSocket+1, &receive, 0, 0, &timeout);
 }
 
-static void kasa_receive (void) {
+// Receive and decode one response. Return the length of the data,
+// or -1 on error.
+//
+static int kasa_read (char *data, int size, struct sockaddr_in *addr) {
 
-    char encoded[1024];
-    char data[1025];
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
+    static char encoded[KASAMAXDATA];
+    socklen_t addrlen = sizeof(*addr);
 
-    int size = recvfrom (KasaSocket, encoded, sizeof(encoded), 0,
-                         (struct sockaddr *)(&addr), &addrlen);
+    int length = recvfrom (KasaSocket, encoded, sizeof(encoded), 0,
+                           (struct sockaddr *)addr, &addrlen);
+
+    if (length <= 0) return -1;
+    if (length >= size) length = size - 1;
 
-    if (size <= 0) {
-        printf ("** recvfrom() error: %s\n", strerror(errno));
-        return;
-    }
     int i;
     char key = 0xab;
-    for (i = 0; i < size; ++i) {
+    for (i = 0; i < length; ++i) {
         data[i] = key ^ encoded[i];
         key = encoded[i];
     }
     data[i] = 0;
+    return length;
+}
+
+static void kasa_receive (void) {
+
+    static char data[KASAMAXDATA+1];
+    struct sockaddr_in addr;
+
+    if (kasa_read (data, sizeof(data), &addr) < 0) {
+        printf ("** recvfrom() error: %s\n", strerror(errno));
+        return;
+    }
     int ip = htonl(addr.sin_addr.s_addr);
     printf ("Received from %d.%d.%d.%d: %s\n",
             0xff & (ip >> 24), 0xff & (ip >> 16), 0xff & (ip >> 8), 0xff & ip,
             data);
 }
 
+// Decode a network specification "a.b.c.d/n" into its first host address
+// (host byte order) and number of host addresses. A single address is
+// accepted as a /32 network.
+//
+static int kasa_network (const char *cidr,
+                         unsigned int *first, unsigned int *count) {
+
+    char address[64];
+    int bits = 32;
+    struct in_addr addr;
+
+    snprintf (address, sizeof(address), "%s", cidr);
+    char *slash = strchr (address, '/');
+    if (slash) {
+        *slash = 0;
+        bits = atoi(slash+1);
+        if (bits < 16 || bits > 32) return 0;
+    }
+    if (!inet_aton (address, &addr)) return 0;
+
+    unsigned int mask = (bits == 32) ? 0xffffffff : ~(0xffffffffu >> bits);
+    unsigned int base = ntohl(addr.s_addr) & mask;
+    unsigned int size = (bits == 32) ? 1 : (0xffffffffu >> bits) + 1;
+
+    // Skip the network and broadcast addresses, except on point-to-point
+    // networks (/31) and single hosts.
+    if (size > 2) {
+        *first = base + 1;
+        *count = size - 2;
+    } else {
+        *first = base;
+        *count = size;
+    }
+    return 1;
+}
+
+static void kasa_scan (const char *cidr, int rate, int timeout) {
+
+    static char data[KASAMAXDATA+1];
+    unsigned int first;
+    unsigned int count;
+    unsigned int next = 0;
+    unsigned int answered = 0;
+    unsigned int errors = 0;
+
+    if (!kasa_network (cidr, &first, &count)) {
+        fprintf (stderr, "Invalid network %s (expected a.b.c.d/n, n >= 16)\n",
+                 cidr);
+        exit(1);
+    }
+    if (rate <= 0) rate = 100;
+
+    long long *sent = calloc (count, sizeof(long long));
+    char *seen = calloc (count, 1);
+    long long start = kasa_now();
+    long long last = start;
+
+    struct pollfd fds[1];
+    fds[0].fd = KasaSocket;
+    fds[0].events = POLLIN;
+
+    while (answered < count) {
+
+        long long now = kasa_now();
+
+        // Send all the requests that are due, at the requested pace.
+        while (next < count && now >= start + ((long long)next * 1000) / rate) {
+            struct sockaddr_in addr;
+            memset (&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(KasaPort);
+            addr.sin_addr.s_addr = htonl(first + next);
+            if (kasa_send_to (&addr, "{\"system\":{\"get_sysinfo\":{}}}") < 0)
+                errors += 1;
+            sent[next++] = last = now;
+        }
+
+        long long deadline;
+        if (next < count)
+            deadline = start + ((long long)next * 1000) / rate;
+        else
+            deadline = last + timeout;
+        if (now >= deadline) {
+            if (next >= count) break; // Done waiting.
+            continue;
+        }
+
+        if (poll (fds, 1, (int)(deadline - now)) <= 0) continue;
+
+        struct sockaddr_in addr;
+        int length = kasa_read (data, sizeof(data), &addr);
+        if (length <= 0) continue;
+
+        unsigned int index = ntohl(addr.sin_addr.s_addr) - first;
+        if (index >= count) continue; // Not an address we scanned.
+        if (seen[index]) continue; // Duplicate response.
+        seen[index] = 1;
+        answered += 1;
+        printf ("{\"address\":\"%s\",\"rtt\":%lld,\"response\":%s}\n",
+                inet_ntoa(addr.sin_addr), kasa_now() - sent[index], data);
+        fflush (stdout);
+    }
+    fprintf (stderr, "Scanned %u addresses in %lld ms: %u responded, %u send errors\n",
+             next, kasa_now() - start, answered, errors);
+    free (sent);
+    free (seen);
+}
+
 static int kasa_resolve (const char *host) {
 
     int result = 0;
     struct addrinfo hints;
     struct addrinfo *resolved;
     struct addrinfo *cursor;
+    memset (&hints, 0, sizeof(hints));
     hints.ai_flags = AI_ADDRCONFIG;
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM;
@@ -173,6 +335,106 @@ static int kasa_resolve (const char *host) {
     return result;
 }
 
+static int kasa_compare (const void *a, const void *b) {
+    long long d = *((const long long *)a) - *((const long long *)b);
+    return (d > 0) - (d < 0);
+}
+
+static double kasa_percentile (const long long *sorted, int count, int p) {
+    if (count <= 0) return 0.0;
+    int rank = ((count * p) + 99) / 100; // Nearest rank.
+    if (rank < 1) rank = 1;
+    return sorted[rank-1] / 1000.0;
+}
+
+static void kasa_bench (int total, int rate, int toggle, int timeout) {
+
+    static char data[KASAMAXDATA+1];
+    int next = 0;
+    int matched = 0;
+    int errors = 0;
+    int lost = 0;
+
+    if (rate <= 0) rate = 10;
+
+    long long *rtt = calloc (total, sizeof(long long));
+    long long start = kasa_now_us();
+
+    struct pollfd fds[1];
+    fds[0].fd = KasaSocket;
+    fds[0].events = POLLIN;
+
+    // One request is outstanding at a time: the Kasa protocol has no
+    // request identifier, so a response can only be matched with the last
+    // request sent. A request not answered within the timeout is lost.
+    //
+    while (next < total) {
+
+        long long now = kasa_now_us();
+        long long scheduled = start + ((long long)next * 1000000) / rate;
+        if (now < scheduled) {
+            usleep ((useconds_t)(scheduled - now));
+            now = kasa_now_us();
+        }
+
+        // After a loss, use a new socket (i.e. a new source port): a late
+        // response to the lost request is then dropped by the kernel, and
+        // cannot be taken for the response to the next request.
+        //
+        if (lost) {
+            struct sockaddr_in target = KasaAddress;
+            close (KasaSocket);
+            kasa_socket ();
+            KasaAddress = target;
+            fds[0].fd = KasaSocket;
+            lost = 0;
+        }
+        struct sockaddr_in addr;
+
+        const char *request = "{\"system\":{\"get_sysinfo\":{}}}";
+        if (toggle) {
+            request = (next & 1) ?
+                "{\"system\":{\"set_relay_state\":{\"state\":0}}}" :
+                "{\"system\":{\"set_relay_state\":{\"state\":1}}}";
+        }
+        next += 1;
+        if (kasa_send_to (&KasaAddress, request) < 0) {
+            errors += 1;
+            continue;
+        }
+        long long sent = now;
+        long long deadline = sent + (timeout * 1000LL);
+
+        for (;;) {
+            now = kasa_now_us();
+            if (now >= deadline) {
+                lost = 1;
+                break;
+            }
+            int wait = (int)((deadline - now + 999) / 1000);
+            if (poll (fds, 1, wait) <= 0) continue;
+            if (kasa_read (data, sizeof(data), &addr) <= 0) continue;
+            if (addr.sin_addr.s_addr != KasaAddress.sin_addr.s_addr) continue;
+            rtt[matched++] = kasa_now_us() - sent;
+            break;
+        }
+    }
+
+    qsort (rtt, matched, sizeof(long long), kasa_compare);
+
+    printf ("sent %d, received %d, lost %d (%.1f%%), send errors %d\n",
+            next, matched, next - matched,
+            next ? ((next - matched) * 100.0) / next : 0.0, errors);
+    if (matched > 0) {
+        printf ("rtt (ms): p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+                kasa_percentile (rtt, matched, 50),
+                kasa_percentile (rtt, matched, 95),
+                kasa_percentile (rtt, matched, 99),
+                rtt[matched-1] / 1000.0);
+    }
+    free (rtt);
+}
+
 static void kasa_help (int status) {
     printf ("kasa:                         query the status of all devices\n");
     printf ("kasa <host>:                  query the status of the specified device\n");
@@ -181,6 +443,10 @@ static void kasa_help (int status) {
     printf ("kasa <host> off [hs220]:      turn the specified device off\n");
     printf ("kasa <host> on [kp400 <id>]:  turn the specified subdevice on\n");
     printf ("kasa <host> off [kp400 <id>]: turn the specified subdevice off\n");
+    printf ("kasa --scan <cidr> [--rate <n>] [--timeout <ms>]:\n"
+            "                              query all addresses in a network\n");
+    printf ("kasa <host> --bench <n> [--rate <r>] [--toggle] [--timeout <ms>]:\n"
+            "                              measure loss and round trip time\n");
     printf ("kasa -h|--help|help:          show this help text\n");
     exit (status);
 }
@@ -198,6 +464,24 @@ int main (int argc, char **argv) {
        if (!strcmp(argv[1], "-h")) kasa_help (0);
        if (!strcmp(argv[1], "--help")) kasa_help (0);
        if (!strcmp(argv[1], "help")) kasa_help (0);
+       if (!strcmp(argv[1], "--scan")) {
+           int i;
+           int rate = 100;
+           int timeout = 2000;
+           if (argc < 3) kasa_help (1);
+           for (i = 3; i < argc; ++i) {
+               if (!strcmp(argv[i], "--rate") && i+1 < argc)
+                   rate = atoi(argv[++i]);
+               else if (!strcmp(argv[i], "--timeout") && i+1 < argc)
+                   timeout = atoi(argv[++i]);
+               else
+                   kasa_help (1);
+           }
+           KasaQuiet = 1;
+           kasa_socket ();
+           kasa_scan (argv[2], rate, timeout);
+           return 0;
+       }
        host = argv[1];
        if (argc >= 3) {
            cmd = argv[2];
@@ -210,6 +494,32 @@ int main (int argc, char **argv) {
        }
     }
     
+    if (cmd && !strcmp (cmd, "--bench")) {
+        int i;
+        int rate = 10;
+        int toggle = 0;
+        int timeout = 2000;
+        if (!model || atoi(model) <= 0) kasa_help (1);
+        for (i = 4; i < argc; ++i) {
+            if (!strcmp(argv[i], "--rate") && i+1 < argc)
+                rate = atoi(argv[++i]);
+            else if (!strcmp(argv[i], "--timeout") && i+1 < argc)
+                timeout = atoi(argv[++i]);
+            else if (!strcmp(argv[i], "--toggle"))
+                toggle = 1;
+            else
+                kasa_help (1);
+        }
+        KasaQuiet = 1;
+        kasa_socket ();
+        if (!kasa_resolve (host)) {
+            printf ("Cannot resolve %s\n", host);
+            kasa_help(1);
+        }
+        kasa_bench (atoi(model), rate, toggle, timeout);
+        return 0;
+    }
+
     kasa_socket ();
     if (host) {
         if (!kasa_resolve (host)) {
@@ -227,39 +537,34 @@ int main (int argc, char **argv) {
                       model);
             kasa_send (buffer);
         }
-    } else if (!strcmp (cmd, "on")) {
-        if (!model) {
-            kasa_send ("{\"system\":{\"set_relay_state\":{\"state\":1}}}");
-        } else if (!strcmp (model, "kp400")) {
+    } else if ((!strcmp (cmd, "on")) || (!strcmp (cmd, "off"))) {
+        int kind = housekasa_model_search (model);
+        int features = housekasa_model_features (kind);
+        int state = !strcmp (cmd, "on");
+        if (model && !kind)
+            printf ("Unknown model %s, using the generic protocol\n", model);
+        if (features & KASA_MODEL_CHILDREN) {
             if (!id) {
                 printf ("Outlet ID is required\n");
                 exit (1);
             }
-            snprintf (buffer, sizeof(buffer),
-                      "{\"context\":{\"child_ids\":[\"%s\"]},\"system\":{\"set_relay_state\":{\"state\":1}}}", id);
-            kasa_send (buffer);
-        } else if (!strcmp (model, "hs220")) {
-            kasa_send ("{\"smartlife.iot.dimmer\":{\"set_switch_state\":{\"state\":1}}}");
-        }
-    } else if (!strcmp (cmd, "off")) {
-        if (!model) {
-            kasa_send ("{\"system\":{\"set_relay_state\":{\"state\":0}}}");
-        } else if (!strcmp (model, "kp400")) {
-            if (!id) {
-                printf ("Outlet ID is required\n");
+            if (!housekasa_model_control (kind, buffer, sizeof(buffer), "",
+                                          &id, 1, state, 0, "")) {
+                printf ("Outlet ID is too long\n");
                 exit (1);
             }
-            snprintf (buffer, sizeof(buffer),
-                      "{\"context\":{\"child_ids\":[\"%s\"]},\"system\":{\"set_relay_state\":{\"state\":0}}}", id);
-            kasa_send (buffer);
-        } else if (!strcmp (model, "hs220")) {
-            kasa_send ("{\"smartlife.iot.dimmer\":{\"set_switch_state\":{\"state\":0}}}");
+        } else if (!housekasa_model_switch (kind, buffer,
+                                            sizeof(buffer), state)) {
+            // Not a dimmer, and single outlet: the outlet ID is ignored.
+            housekasa_model_control (kind, buffer, sizeof(buffer), "",
+                                     0, 0, state, 0, "");
         }
+        kasa_send (buffer);
     } else {
         printf ("Invalid command %s\n", cmd);
         kasa_help(1);
     }
-    while (kasa_wait() > 0) kasa_receive();
+    while (kasa_wait(2000) > 0) kasa_receive();
     return 0;
 }
 